@@ -33,3 +33,9 @@ PRODUCT_COPY_FILES += \
     vendor/renesas/hal/audio/car_audio_configuration.xml:$(TARGET_COPY_OUT_VENDOR)/etc/car_audio_configuration.xml
 
 DEVICE_PACKAGE_OVERLAYS += vendor/renesas/hal/audio/overlay
+
+# AAudio tries MMAP first and falls back to the legacy path on boards whose
+# HAL has no MMAP PCM
+PRODUCT_PROPERTY_OVERRIDES += \
+    aaudio.mmap_policy=2 \
+    aaudio.mmap_exclusive_policy=2
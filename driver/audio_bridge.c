@@ -0,0 +1,192 @@
+/*
+ * Copyright (C) 2019 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_generic"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <log/log.h>
+
+#include "audio_bridge.h"
+
+// Capture and playback clocks may drift apart. Once this many reads are
+// pending in the capture PCM one is dropped to keep the latency bounded.
+#define BRIDGE_MAX_PENDING_READS 3
+
+#define BRIDGE_GAIN_UNITY (1 << 15)
+
+static void bridge_close_pcm(struct audio_bridge *bridge) {
+    if (bridge->pcm) {
+        pcm_close(bridge->pcm);
+        bridge->pcm = NULL;
+    }
+}
+
+static int bridge_open_pcm(struct audio_bridge *bridge) {
+    bridge->pcm = pcm_open(bridge->card, bridge->device, PCM_IN, &bridge->config);
+    if (!pcm_is_ready(bridge->pcm)) {
+        ALOGE("%s: pcm_open(%u, %u) failed: %s", __func__, bridge->card, bridge->device,
+              pcm_get_error(bridge->pcm));
+        bridge_close_pcm(bridge);
+        return -ENODEV;
+    }
+    // Started right away, reads only happen once a whole chunk is there
+    if (pcm_start(bridge->pcm) != 0) {
+        ALOGE("%s: pcm_start(%u, %u) failed: %s", __func__, bridge->card, bridge->device,
+              pcm_get_error(bridge->pcm));
+        bridge_close_pcm(bridge);
+        return -ENODEV;
+    }
+    return 0;
+}
+
+// Pull callback of the output engine. Never blocks on the capture PCM: if a
+// chunk is not there yet the engine gets silence for this period.
+static int bridge_pull(void *cookie, int32_t *mix, unsigned int frame_count,
+                       uint64_t position) {
+    struct audio_bridge *bridge = (struct audio_bridge *)cookie;
+    const unsigned int out_channels = bridge->ext_pcm->config.channels;
+    const unsigned int in_channels = bridge->config.channels;
+    const unsigned int in_frames = bridge->resampler ?
+            (frame_count * bridge->config.rate) / bridge->ext_pcm->config.rate : frame_count;
+
+    if (!bridge->pcm && bridge_open_pcm(bridge) != 0) {
+        return -ENODATA;
+    }
+
+    unsigned int avail;
+    struct timespec tstamp;
+    if (pcm_get_htimestamp(bridge->pcm, &avail, &tstamp) != 0) {
+        // Overrun, restart the capture
+        pcm_prepare(bridge->pcm);
+        pcm_start(bridge->pcm);
+        return frame_count;
+    }
+    if (avail < in_frames) {
+        return frame_count;
+    }
+    if (avail >= in_frames * BRIDGE_MAX_PENDING_READS) {
+        ALOGV("%s: capture ahead by %u frames, dropping %u", __func__, avail, in_frames);
+        pcm_read(bridge->pcm, bridge->read_buffer, pcm_frames_to_bytes(bridge->pcm, in_frames));
+    }
+    if (pcm_read(bridge->pcm, bridge->read_buffer,
+                 pcm_frames_to_bytes(bridge->pcm, in_frames)) != 0) {
+        ALOGE("%s: pcm_read(%u, %u) failed: %s", __func__, bridge->card, bridge->device,
+              pcm_get_error(bridge->pcm));
+        bridge_close_pcm(bridge);
+        return frame_count;
+    }
+
+    const int16_t *input = bridge->read_buffer;
+    size_t frames = in_frames;
+    if (bridge->resampler) {
+        size_t in_count = in_frames;
+        frames = frame_count;
+        bridge->resampler->resample_from_input(bridge->resampler, bridge->read_buffer,
+                                               &in_count, bridge->resampled_buffer, &frames);
+        input = bridge->resampled_buffer;
+    }
+
+    // Capture channels are repeated across the output channels
+    const int32_t gain_q15 = atomic_load_explicit(&bridge->gain_q15, memory_order_relaxed);
+    for (size_t frame = 0; frame < frames; frame++) {
+        for (unsigned int channel = 0; channel < out_channels; channel++) {
+            mix[frame * out_channels + channel] +=
+                    (input[frame * in_channels + channel % in_channels] * gain_q15) >> 15;
+        }
+    }
+    return frames;
+}
+
+struct audio_bridge *audio_bridge_open(unsigned int card, unsigned int device,
+                                       const struct pcm_config *config,
+                                       unsigned int out_card, unsigned int out_device,
+                                       unsigned int out_flags,
+                                       const struct pcm_config *out_config,
+                                       unsigned int warm_standby_ms,
+                                       const struct audio_thread_config *engine_thread_config) {
+    struct audio_bridge *bridge = calloc(1, sizeof(struct audio_bridge));
+    if (!bridge) {
+        return NULL;
+    }
+    bridge->card = card;
+    bridge->device = device;
+    bridge->config = *config;
+    atomic_init(&bridge->gain_q15, BRIDGE_GAIN_UNITY);
+
+    bridge->ext_pcm = ext_pcm_open(out_card, out_device, out_flags, out_config,
+                                   warm_standby_ms, engine_thread_config);
+    if (!bridge->ext_pcm) {
+        free(bridge);
+        return NULL;
+    }
+
+    // Sized for a whole engine period, the largest chunk pulled
+    const struct pcm_config *engine_config = &bridge->ext_pcm->config;
+    const size_t in_frames = (engine_config->period_size * config->rate) / engine_config->rate;
+    bridge->read_buffer = calloc(in_frames * config->channels, sizeof(int16_t));
+    if (config->rate != engine_config->rate) {
+        bridge->resampled_buffer =
+                calloc(engine_config->period_size * config->channels, sizeof(int16_t));
+        if (create_resampler(config->rate, engine_config->rate, config->channels,
+                             RESAMPLER_QUALITY_DEFAULT, NULL, &bridge->resampler) != 0) {
+            bridge->resampler = NULL;
+        }
+    }
+    if (!bridge->read_buffer ||
+        (config->rate != engine_config->rate &&
+         (!bridge->resampled_buffer || !bridge->resampler))) {
+        ALOGE("%s: cannot set up %u,%u -> %u,%u", __func__, card, device, out_card, out_device);
+        goto error;
+    }
+
+    if (ext_pcm_add_source(bridge->ext_pcm, bridge_pull, bridge, 0) != 0) {
+        goto error;
+    }
+    ext_pcm_kick(bridge->ext_pcm);
+    ALOGD("%s: %u,%u -> %u,%u", __func__, card, device, out_card, out_device);
+    return bridge;
+
+error:
+    if (bridge->resampler) {
+        release_resampler(bridge->resampler);
+    }
+    free(bridge->resampled_buffer);
+    free(bridge->read_buffer);
+    ext_pcm_close(bridge->ext_pcm);
+    free(bridge);
+    return NULL;
+}
+
+void audio_bridge_close(struct audio_bridge *bridge) {
+    // The engine is done with the capture PCM once the source is removed
+    ext_pcm_remove_source(bridge->ext_pcm, bridge);
+    ext_pcm_close(bridge->ext_pcm);
+    bridge_close_pcm(bridge);
+    if (bridge->resampler) {
+        release_resampler(bridge->resampler);
+    }
+    free(bridge->resampled_buffer);
+    free(bridge->read_buffer);
+    ALOGD("%s: %u,%u", __func__, bridge->card, bridge->device);
+    free(bridge);
+}
+
+void audio_bridge_set_gain(struct audio_bridge *bridge, int32_t gain_q15) {
+    atomic_store_explicit(&bridge->gain_q15, gain_q15, memory_order_relaxed);
+}
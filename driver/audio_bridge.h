@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2019 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AUDIO_BRIDGE_H
+#define AUDIO_BRIDGE_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include <tinyalsa/asoundlib.h>
+#include <audio_utils/resampler.h>
+
+#include "ext_pcm.h"
+
+// Device to device patch realized inside the HAL. The capture PCM is a source
+// of the output engine: the engine thread reads it without blocking, adapts
+// rate and channels and mixes it like any stream, so no framework threads or
+// extra buffers are involved.
+struct audio_bridge {
+    unsigned int card;              // Capture PCM, constant after init
+    unsigned int device;            // Constant after init
+    struct pcm_config config;       // Constant after init
+    struct ext_pcm *ext_pcm;        // Constant after init
+    atomic_int gain_q15;            // Applied while mixing
+
+    // Owned by the engine thread
+    struct pcm *pcm;
+    struct resampler_itfe *resampler;
+    int16_t *read_buffer;
+    int16_t *resampled_buffer;
+};
+
+// Opens the engine of out_card/out_device and starts mixing the capture PCM
+// card/device into it
+struct audio_bridge *audio_bridge_open(unsigned int card, unsigned int device,
+                                       const struct pcm_config *config,
+                                       unsigned int out_card, unsigned int out_device,
+                                       unsigned int out_flags,
+                                       const struct pcm_config *out_config,
+                                       unsigned int warm_standby_ms,
+                                       const struct audio_thread_config *engine_thread_config);
+void audio_bridge_close(struct audio_bridge *bridge);
+// Q15, 1 << 15 is unity gain
+void audio_bridge_set_gain(struct audio_bridge *bridge, int32_t gain_q15);
+
+#endif  // AUDIO_BRIDGE_H
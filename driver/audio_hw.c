@@ -25,6 +25,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <math.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -33,12 +34,15 @@
 
 #include <log/log.h>
 #include <cutils/str_parms.h>
-#include <cutils/list.h>
 
 #include <hardware/hardware.h>
 #include <system/audio.h>
 
 #include "audio_hw.h"
+#include "audio_bridge.h"
+#include "audio_mmap.h"
+#include "audio_platform.h"
+#include "audio_thread.h"
 #include "ext_pcm.h"
 #include "buffer_utils.h"
 
@@ -49,6 +53,18 @@
 #define OUT_PERIOD_COUNT 4
 
 #define OUT_PERIOD_SIZE 512
+
+// Low-latency (AUDIO_OUTPUT_FLAG_FAST) outputs
+#define OUT_FAST_PERIOD_SIZE 192
+#define OUT_FAST_PERIOD_COUNT 2
+
+// Batched (AUDIO_OUTPUT_FLAG_DIRECT) PCM outputs: the client queue, and the
+// batch the stream worker converts per wakeup in engine periods
+#ifndef OUT_BATCHED_BUFFER_MS
+#define OUT_BATCHED_BUFFER_MS 1000
+#endif // OUT_BATCHED_BUFFER_MS
+
+#define OUT_BATCH_PERIODS 16
 #define IN_PERIOD_MS 15
 #define IN_PERIOD_COUNT 4
 #define IN_PERIOD_SIZE 512
@@ -90,6 +106,19 @@
 #define PCM_DEVICE_FM UINT32_MAX
 #endif // PCM_DEVICE_FM
 
+// Analog line/aux input, only used for device to device patches
+#ifndef PCM_CARD_AUX
+#define PCM_CARD_AUX UINT32_MAX
+#endif // PCM_CARD_AUX
+
+#ifndef PCM_DEVICE_AUX
+#define PCM_DEVICE_AUX UINT32_MAX
+#endif // PCM_DEVICE_AUX
+
+#ifndef IN_CHANNELS_AUX
+#define IN_CHANNELS_AUX 2
+#endif // IN_CHANNELS_AUX
+
 #ifndef PCM_CARD_HFP
 #define PCM_CARD_HFP UINT32_MAX
 #endif // PCM_CARD_FM
@@ -98,6 +127,60 @@
 #define PCM_DEVICE_HFP UINT32_MAX
 #endif // PCM_DEVICE_FM
 
+// Dedicated PCM for MMAP/no-IRQ streams. The client owns the DMA buffer, so
+// it cannot share the device with the output engine. Unset disables MMAP.
+#ifndef PCM_CARD_MMAP
+#define PCM_CARD_MMAP UINT32_MAX
+#endif // PCM_CARD_MMAP
+
+#ifndef PCM_DEVICE_MMAP
+#define PCM_DEVICE_MMAP UINT32_MAX
+#endif // PCM_DEVICE_MMAP
+
+// Dedicated PCM for low-latency outputs. Unset mixes them on the default PCM,
+// which then runs in OUT_FAST_PERIOD_SIZE quanta while one is active.
+#ifndef PCM_CARD_FAST
+#define PCM_CARD_FAST UINT32_MAX
+#endif // PCM_CARD_FAST
+
+#ifndef PCM_DEVICE_FAST
+#define PCM_DEVICE_FAST UINT32_MAX
+#endif // PCM_DEVICE_FAST
+
+#ifndef OUT_CHANNELS_MMAP
+#define OUT_CHANNELS_MMAP 2
+#endif // OUT_CHANNELS_MMAP
+
+// Capture PCM of the built-in mic for MMAP streams. It is not shared with the
+// regular capture workers. Unset disables MMAP capture.
+#ifndef PCM_CARD_MMAP_IN
+#define PCM_CARD_MMAP_IN UINT32_MAX
+#endif // PCM_CARD_MMAP_IN
+
+#ifndef PCM_DEVICE_MMAP_IN
+#define PCM_DEVICE_MMAP_IN UINT32_MAX
+#endif // PCM_DEVICE_MMAP_IN
+
+#ifndef IN_CHANNELS_MMAP
+#define IN_CHANNELS_MMAP IN_CHANNELS_DEFAULT
+#endif // IN_CHANNELS_MMAP
+
+// 2 ms bursts, the buffer is fitted to the client request within these bounds
+#define MMAP_PERIOD_SIZE (DEFAULT_OUT_SAMPLING_RATE / 500)
+#define MMAP_PERIOD_COUNT_MIN 32
+#define MMAP_PERIOD_COUNT_MAX 512
+
+// Board description that overrides platform_dependencies.h, see
+// audio_platform_load()
+#ifndef AUDIO_PLATFORM_INFO_PATH
+#define AUDIO_PLATFORM_INFO_PATH "/vendor/etc/audio_platform_info.xml"
+#endif // AUDIO_PLATFORM_INFO_PATH
+
+// Bus gain stages are read from the <gains> of the bus device ports
+#ifndef AUDIO_POLICY_CONFIG_PATH
+#define AUDIO_POLICY_CONFIG_PATH "/vendor/etc/audio_policy_configuration.xml"
+#endif // AUDIO_POLICY_CONFIG_PATH
+
 #ifndef DEFAULT_OUT_SAMPLING_RATE
 #define DEFAULT_OUT_SAMPLING_RATE   48000
 #endif // DEFAULT_OUT_SAMPLING_RATE
@@ -110,16 +193,98 @@
 #define DEFAULT_HFP_SAMPLING_RATE   16000
 #endif // DEFAULT_HFP_SAMPLING_RATE
 
-#ifndef HFP_STREAM_BT_OUT_ADDRESS
-#define HFP_STREAM_BT_OUT_ADDRESS   ""
-#endif // HFP_STREAM_BT_OUT_ADDRESS
-
-#define SLEEP_MAX 200000
-#define SLEEP_MS 10000
+// HFP volume steps as mapped by PrimaryDevice::setBtHfpVolume, the top step
+// is unity gain and every step below attenuates by HFP_VOLUME_STEP_DB
+#define HFP_VOLUME_MAX 15
+#define HFP_VOLUME_STEP_DB 3
+
+// mSBC (wideband) and CVSD (narrowband) SCO rates
+#define HFP_WB_SAMPLING_RATE 16000
+#define HFP_NB_SAMPLING_RATE 8000
+
+// Per channel trim of the microphone PCM in millibels, e.g.
+// "mic_trim=0,-50,120,0,0,0". Channels that are not listed get unity.
+#define AUDIO_PARAMETER_KEY_MIC_TRIM "mic_trim"
+
+// Worker thread scheduling, see audio_thread.h. Platforms may override
+// any of these in platform_dependencies.h
+#ifndef IN_WORKER_SCHED_POLICY
+#define IN_WORKER_SCHED_POLICY SCHED_FIFO
+#endif // IN_WORKER_SCHED_POLICY
+
+#ifndef IN_WORKER_SCHED_PRIORITY
+#define IN_WORKER_SCHED_PRIORITY 2
+#endif // IN_WORKER_SCHED_PRIORITY
+
+#ifndef IN_WORKER_CPU_MASK
+#define IN_WORKER_CPU_MASK 0
+#endif // IN_WORKER_CPU_MASK
+
+#ifndef HFP_WORKER_SCHED_POLICY
+#define HFP_WORKER_SCHED_POLICY SCHED_FIFO
+#endif // HFP_WORKER_SCHED_POLICY
+
+#ifndef HFP_WORKER_SCHED_PRIORITY
+#define HFP_WORKER_SCHED_PRIORITY 3
+#endif // HFP_WORKER_SCHED_PRIORITY
+
+#ifndef HFP_WORKER_CPU_MASK
+#define HFP_WORKER_CPU_MASK 0
+#endif // HFP_WORKER_CPU_MASK
+
+#ifndef OUT_ENGINE_SCHED_POLICY
+#define OUT_ENGINE_SCHED_POLICY SCHED_FIFO
+#endif // OUT_ENGINE_SCHED_POLICY
+
+#ifndef OUT_ENGINE_SCHED_PRIORITY
+#define OUT_ENGINE_SCHED_PRIORITY 3
+#endif // OUT_ENGINE_SCHED_PRIORITY
+
+#ifndef OUT_ENGINE_CPU_MASK
+#define OUT_ENGINE_CPU_MASK 0
+#endif // OUT_ENGINE_CPU_MASK
+
+// Output stream workers post callbacks and run PCM batches well ahead of
+// the engine, so they need no RT class. Point OUT_WORKER_CPU_MASK at the
+// little cores on big.LITTLE parts.
+#ifndef OUT_WORKER_SCHED_POLICY
+#define OUT_WORKER_SCHED_POLICY SCHED_OTHER
+#endif // OUT_WORKER_SCHED_POLICY
+
+#ifndef OUT_WORKER_SCHED_PRIORITY
+#define OUT_WORKER_SCHED_PRIORITY 0
+#endif // OUT_WORKER_SCHED_PRIORITY
+
+#ifndef OUT_WORKER_CPU_MASK
+#define OUT_WORKER_CPU_MASK 0
+#endif // OUT_WORKER_CPU_MASK
+
+// Grace periods before an idle PCM is closed. An output keeps playing
+// silence and a capture PCM is stopped but left open, so back to back
+// writes across a standby skip pcm_open() and codec startup. 0 disables.
+// The output engine writes that silence, so its window defaults to two
+// periods, rounded up; boards with slow codec startup may raise it.
+#ifndef OUT_WARM_STANDBY_PERIODS
+#define OUT_WARM_STANDBY_PERIODS 2
+#endif // OUT_WARM_STANDBY_PERIODS
+
+#ifndef OUT_WARM_STANDBY_MS
+#define OUT_WARM_STANDBY_MS \
+    ((OUT_WARM_STANDBY_PERIODS * OUT_PERIOD_SIZE * 1000 + DEFAULT_OUT_SAMPLING_RATE - 1) / \
+     DEFAULT_OUT_SAMPLING_RATE)
+#endif // OUT_WARM_STANDBY_MS
+
+#ifndef IN_WARM_STANDBY_MS
+#define IN_WARM_STANDBY_MS 1000
+#endif // IN_WARM_STANDBY_MS
+
+// Upper bound for all HFP workers to park before a call is started
+#define HFP_READY_TIMEOUT_MS 200
 
 #define HFP_IN_ACTIVE_FLAG 0x1
 #define MIC_IN_ACTIVE_FLAG 0x2
 #define HFP_OUT_ACTIVE_FLAG 0x4
+#define ALL_IN_ACTIVE_FLAG (HFP_IN_ACTIVE_FLAG | MIC_IN_ACTIVE_FLAG)
 #define ALL_ACTIVE_FLAG (HFP_IN_ACTIVE_FLAG | MIC_IN_ACTIVE_FLAG | HFP_OUT_ACTIVE_FLAG)
 
 #define _bool_str(x) ((x)?"true":"false")
@@ -145,6 +310,30 @@ struct pcm_config pcm_config_out_hfp = {
     .format = PCM_FORMAT_S16_LE
 };
 
+static struct pcm_config pcm_config_out_fast = {
+    .channels = OUT_CHANNELS_DEFAULT,
+    .rate = DEFAULT_OUT_SAMPLING_RATE,
+    .period_size = OUT_FAST_PERIOD_SIZE,
+    .period_count = OUT_FAST_PERIOD_COUNT,
+    .format = PCM_FORMAT_S16_LE,
+};
+
+static struct pcm_config pcm_config_out_mmap = {
+    .channels = OUT_CHANNELS_MMAP,
+    .rate = DEFAULT_OUT_SAMPLING_RATE,
+    .period_size = MMAP_PERIOD_SIZE,
+    .period_count = MMAP_PERIOD_COUNT_MIN,
+    .format = PCM_FORMAT_S16_LE,
+};
+
+static struct pcm_config pcm_config_in_mmap = {
+    .channels = IN_CHANNELS_MMAP,
+    .rate = DEFAULT_IN_SAMPLING_RATE,
+    .period_size = MMAP_PERIOD_SIZE,
+    .period_count = MMAP_PERIOD_COUNT_MIN,
+    .format = PCM_FORMAT_S16_LE,
+};
+
 static struct pcm_config pcm_config_in_default = {
     .channels = IN_CHANNELS_DEFAULT,
     .rate = DEFAULT_IN_SAMPLING_RATE,
@@ -163,6 +352,14 @@ static struct pcm_config pcm_config_in_fm = {
     .format = PCM_FORMAT_S16_LE,
 };
 
+static struct pcm_config pcm_config_in_aux = {
+    .channels = IN_CHANNELS_AUX,
+    .rate = DEFAULT_IN_SAMPLING_RATE,
+    .period_size = IN_PERIOD_SIZE,
+    .period_count = IN_PERIOD_COUNT,
+    .format = PCM_FORMAT_S16_LE,
+};
+
 struct pcm_config pcm_config_in_hfp = {
     .channels = IN_CHANNELS_HFP,
     .rate = DEFAULT_HFP_SAMPLING_RATE,
@@ -171,15 +368,61 @@ struct pcm_config pcm_config_in_hfp = {
     .format = PCM_FORMAT_S16_LE
 };
 
+// Built in board description, AUDIO_PLATFORM_INFO_PATH may override it at
+// device open
+static struct audio_platform platform = {
+    .out_default = { PCM_CARD_DEFAULT, PCM_DEVICE_DEFAULT, &pcm_config_out_default },
+    .out_hfp = { PCM_CARD_HFP, PCM_DEVICE_HFP, &pcm_config_out_hfp },
+    .out_fast = { PCM_CARD_FAST, PCM_DEVICE_FAST, &pcm_config_out_fast },
+    .out_mmap = { PCM_CARD_MMAP, PCM_DEVICE_MMAP, &pcm_config_out_mmap },
+    .in_default = { PCM_CARD_DEFAULT, PCM_DEVICE_DEFAULT, &pcm_config_in_default },
+    .in_fm = { PCM_CARD_FM, PCM_DEVICE_FM, &pcm_config_in_fm },
+    .in_aux = { PCM_CARD_AUX, PCM_DEVICE_AUX, &pcm_config_in_aux },
+    .in_hfp = { PCM_CARD_HFP, PCM_DEVICE_HFP, &pcm_config_in_hfp },
+    .in_mmap = { PCM_CARD_MMAP_IN, PCM_DEVICE_MMAP_IN, &pcm_config_in_mmap },
+    .cards = cards,
+};
+
+static const struct audio_thread_config in_worker_thread_config = {
+    .name_prefix = "ain",
+    .policy = IN_WORKER_SCHED_POLICY,
+    .priority = IN_WORKER_SCHED_PRIORITY,
+    .cpu_mask = IN_WORKER_CPU_MASK,
+};
+
+static const struct audio_thread_config hfp_worker_thread_config = {
+    .name_prefix = "ahfp",
+    .policy = HFP_WORKER_SCHED_POLICY,
+    .priority = HFP_WORKER_SCHED_PRIORITY,
+    .cpu_mask = HFP_WORKER_CPU_MASK,
+};
+
+static const struct audio_thread_config out_engine_thread_config = {
+    .name_prefix = "aout",
+    .policy = OUT_ENGINE_SCHED_POLICY,
+    .priority = OUT_ENGINE_SCHED_PRIORITY,
+    .cpu_mask = OUT_ENGINE_CPU_MASK,
+};
+
+static const struct audio_thread_config out_worker_thread_config = {
+    .name_prefix = "aow",
+    .policy = OUT_WORKER_SCHED_POLICY,
+    .priority = OUT_WORKER_SCHED_PRIORITY,
+    .cpu_mask = OUT_WORKER_CPU_MASK,
+};
+
 static pthread_mutex_t adev_init_lock = PTHREAD_MUTEX_INITIALIZER;
 static unsigned int audio_device_ref_count = 0;
 
-typedef struct {
-    struct listnode      list;
-    struct audio_patch   patch;
-} patch_list;
+// Gain stage of buses the policy configuration gives none
+static const struct audio_gain bus_gain_stage_default = {
+    .min_value = -3200,
+    .max_value = 600,
+    .step_value = 100,
+};
 
-struct listnode* patch_head = NULL;
+// Largest value count of an ALSA control
+#define MIXER_CTL_MAX_VALUES 128
 
 static int set_route_by_array(struct mixer *mixer, struct route_setting *route,
                               int enable)
@@ -190,7 +433,9 @@ static int set_route_by_array(struct mixer *mixer, struct route_setting *route,
     /* Go through the route array and set each value */
     i = 0;
     while (route[i].ctl_name) {
-        ctl = mixer_get_ctl_by_name(mixer, route[i].ctl_name);
+        ctl = route[i].ctl;
+        if (!ctl)
+            ctl = mixer_get_ctl_by_name(mixer, route[i].ctl_name);
         if (!ctl)
             return -EINVAL;
 
@@ -201,11 +446,22 @@ static int set_route_by_array(struct mixer *mixer, struct route_setting *route,
                 mixer_ctl_set_enum_by_string(ctl, "Off");
         } else {
             /* This ensures multiple (i.e. stereo) values are set jointly */
-            for (j = 0; j < mixer_ctl_get_num_values(ctl); j++) {
-                if (enable)
-                    mixer_ctl_set_value(ctl, j, route[i].intval);
-                else
-                    mixer_ctl_set_value(ctl, j, 0);
+            const unsigned int num_values = mixer_ctl_get_num_values(ctl);
+            const enum mixer_ctl_type type = mixer_ctl_get_type(ctl);
+            if ((type == MIXER_CTL_TYPE_INT || type == MIXER_CTL_TYPE_BOOL) &&
+                num_values <= MIXER_CTL_MAX_VALUES) {
+                /* One ioctl for all values */
+                long values[MIXER_CTL_MAX_VALUES];
+                for (j = 0; j < num_values; j++)
+                    values[j] = enable ? route[i].intval : 0;
+                mixer_ctl_set_array(ctl, values, num_values);
+            } else {
+                for (j = 0; j < num_values; j++) {
+                    if (enable)
+                        mixer_ctl_set_value(ctl, j, route[i].intval);
+                    else
+                        mixer_ctl_set_value(ctl, j, 0);
+                }
             }
         }
         i++;
@@ -214,6 +470,29 @@ static int set_route_by_array(struct mixer *mixer, struct route_setting *route,
     return 0;
 }
 
+/* Looks the controls of a route up once so applying it does no name search */
+static int resolve_route_by_array(struct mixer *mixer, struct route_setting *route)
+{
+    int ret = 0;
+    for (unsigned int i = 0; route && route[i].ctl_name; i++) {
+        route[i].ctl = mixer_get_ctl_by_name(mixer, route[i].ctl_name);
+        if (!route[i].ctl) {
+            ALOGE("%s: no mixer control %s", __func__, route[i].ctl_name);
+            ret = -EINVAL;
+        }
+    }
+    return ret;
+}
+
+static void unresolve_route_by_array(struct route_setting *route)
+{
+    for (unsigned int i = 0; route && route[i].ctl_name; i++) {
+        route[i].ctl = NULL;
+    }
+}
+
+static void close_mixers_by_array(struct device_card *cards);
+
 static int open_mixers_by_array(struct device_card *cards)
 {
     if (!cards) {
@@ -223,20 +502,38 @@ static int open_mixers_by_array(struct device_card *cards)
         cards[counter].mixer = mixer_open(cards[counter].card);
         if (!cards[counter].mixer) {
             ALOGE("Unable to open the mixer for card %d, aborting.", cards[counter].card);
-            for (unsigned int close_counter = 0; close_counter < counter; close_counter++) {
-                mixer_close(cards[close_counter].mixer);
-                cards[close_counter].mixer = 0;
-            }
+            close_mixers_by_array(cards);
             return -EINVAL;
         }
-        if (set_route_by_array(cards[counter].mixer, cards[counter].defaults, 1) != 0) {
+        if (resolve_route_by_array(cards[counter].mixer, cards[counter].defaults) != 0 ||
+            set_route_by_array(cards[counter].mixer, cards[counter].defaults, 1) != 0) {
             ALOGE("Unable to set the route for card %d, aborting.", cards[counter].card);
-            for (unsigned int close_counter = 0; close_counter < counter; close_counter++) {
-                mixer_close(cards[close_counter].mixer);
-                cards[close_counter].mixer = 0;
-            }
+            close_mixers_by_array(cards);
             return -EINVAL;
         }
+        // A route with a missing control fails when a patch needs it, which
+        // falls back to the software bridge
+        for (struct hw_route *route = cards[counter].routes;
+             route && route->source != AUDIO_DEVICE_NONE; route++) {
+            resolve_route_by_array(cards[counter].mixer, route->route);
+        }
+        // Buses whose control is missing keep the software gain
+        for (struct bus_volume *volume = cards[counter].volumes;
+             volume && volume->bus_address; volume++) {
+            volume->ctl = mixer_get_ctl_by_name(cards[counter].mixer, volume->ctl_name);
+            if (!volume->ctl) {
+                ALOGE("%s: no mixer control %s for %s", __func__, volume->ctl_name,
+                      volume->bus_address);
+            }
+        }
+        // Inputs whose control is missing keep the software gain
+        for (struct capture_volume *volume = cards[counter].capture_volumes;
+             volume && volume->ctl_name; volume++) {
+            volume->ctl = mixer_get_ctl_by_name(cards[counter].mixer, volume->ctl_name);
+            if (!volume->ctl) {
+                ALOGE("%s: no mixer control %s for input gain", __func__, volume->ctl_name);
+            }
+        }
     }
     return 0;
 }
@@ -248,6 +545,19 @@ static void close_mixers_by_array(struct device_card *cards)
         return;
     }
     while (cards[counter].card != UINT32_MAX) {
+        unresolve_route_by_array(cards[counter].defaults);
+        for (struct hw_route *route = cards[counter].routes;
+             route && route->source != AUDIO_DEVICE_NONE; route++) {
+            unresolve_route_by_array(route->route);
+        }
+        for (struct bus_volume *volume = cards[counter].volumes;
+             volume && volume->bus_address; volume++) {
+            volume->ctl = NULL;
+        }
+        for (struct capture_volume *volume = cards[counter].capture_volumes;
+             volume && volume->ctl_name; volume++) {
+            volume->ctl = NULL;
+        }
         if (cards[counter].mixer) {
             mixer_close(cards[counter].mixer);
             cards[counter].mixer = 0;
@@ -267,6 +577,11 @@ static int out_set_sample_rate(struct audio_stream *stream, uint32_t rate) {
 
 static size_t out_get_buffer_size(const struct audio_stream *stream) {
     struct generic_stream_out *out = (struct generic_stream_out *)stream;
+    if (out->batched) {
+        // Written in halves of the queue, see out_worker()
+        return (out->batch_queue.frame_count / 2) *
+                audio_stream_out_frame_size(&out->stream);
+    }
     int size = out->pcm_config.period_size *
                 audio_stream_out_frame_size(&out->stream);
 
@@ -297,7 +612,7 @@ static int out_dump(const struct audio_stream *stream, int fd) {
                 "\t\tchannel mask: %08x\n"
                 "\t\tformat: %d\n"
                 "\t\tdevice: %08x\n"
-                "\t\tamplitude ratio: %f\n"
+                "\t\tgain: %d/32768\n"
                 "\t\taudio dev: %p\n\n",
                 out->bus_address,
                 out_get_sample_rate(stream),
@@ -305,7 +620,7 @@ static int out_dump(const struct audio_stream *stream, int fd) {
                 out_get_channels(stream),
                 out_get_format(stream),
                 out->device,
-                out->amplitude_ratio,
+                out->gain_q15,
                 out->dev);
     pthread_mutex_unlock(&out->lock);
     return 0;
@@ -370,7 +685,7 @@ static char *out_get_parameters(const struct audio_stream *stream, const char *k
     } else if (str_parms_get_str(query, AUDIO_PARAMETER_STREAM_SUP_SAMPLING_RATES,
             value, sizeof(value)) >= 0) {
         str_parms_add_int(reply, AUDIO_PARAMETER_STREAM_SUP_SAMPLING_RATES,
-                DEFAULT_OUT_SAMPLING_RATE);
+                pcm_config_out_default.rate);
         str = strdup(str_parms_to_str(reply));
     } else if (str_parms_get_str(query, AUDIO_PARAMETER_STREAM_SUP_CHANNELS,
             value, sizeof(value)) >= 0) {
@@ -385,7 +700,7 @@ static char *out_get_parameters(const struct audio_stream *stream, const char *k
     } else if (str_parms_get_str(query, AUDIO_PARAMETER_STREAM_FRAME_COUNT,
             value, sizeof(value)) >= 0) {
         str_parms_add_int(reply, AUDIO_PARAMETER_STREAM_FRAME_COUNT,
-                OUT_PERIOD_SIZE);
+                out->pcm_config.period_size);
         str = strdup(str_parms_to_str(reply));
     } else {
         str = strdup("");
@@ -406,118 +721,109 @@ static int out_set_volume(struct audio_stream_out *stream,
     return -ENOSYS;
 }
 
-static void *out_write_worker(void *args) {
-    struct generic_stream_out *out = (struct generic_stream_out *)args;
-    struct ext_pcm *ext_pcm = NULL;
-    uint8_t *buffer = NULL;
-    int buffer_frames;
-    int buffer_size;
-    bool close_pcm = false;
-
-    while (true) {
-        pthread_mutex_lock(&out->lock);
+// Reports a stream as parked to the HFP call setup. Called from the engine
+// with out->lock held, so it only takes the hfp_call.ready_lock leaf lock.
+static void hfp_stream_parked(struct generic_audio_device *adev, uint8_t flag) {
+    pthread_mutex_lock(&adev->hfp_call.ready_lock);
+    adev->hfp_call.stream_flag |= flag;
+    pthread_cond_broadcast(&adev->hfp_call.ready);
+    pthread_mutex_unlock(&adev->hfp_call.ready_lock);
+}
 
-        if (out->worker_standby || out->worker_exit) {
-            close_pcm = true;
-        }
+// Clears the parked state before the HFP streams are started or closed
+static void hfp_streams_unparked(struct generic_audio_device *adev) {
+    pthread_mutex_lock(&adev->hfp_call.ready_lock);
+    adev->hfp_call.stream_flag = 0;
+    pthread_mutex_unlock(&adev->hfp_call.ready_lock);
+}
 
-        while (!close_pcm && audio_vbuffer_live(&out->buffer) == 0) {
-            pthread_cond_wait(&out->worker_wake, &out->lock);
-            if (out->worker_standby || out->worker_exit) {
-                close_pcm = true;
-            }
+// Called from the engine with out->lock held once the frames buffered
+// before standby have been played out
+static void out_drain_complete(struct generic_stream_out *out) {
+    ALOGV("%s: address %s", __func__, out->bus_address);
+    out->draining = false;
+    if (out->drain_requested) {
+        out->drain_requested = false;
+        if (out->worker_running) {
+            out->drain_ready = true;
+            pthread_cond_signal(&out->worker_wake);
         }
+        pthread_cond_broadcast(&out->drained);
+    }
+    if (out->device == AUDIO_DEVICE_OUT_BLUETOOTH_SCO) {
+        hfp_stream_parked(out->dev, HFP_OUT_ACTIVE_FLAG);
+    }
+}
 
-        if (close_pcm) {
-            if (ext_pcm) {
-                ext_pcm_close(ext_pcm, out->bus_address); // Frees pcm
-                ext_pcm = NULL;
-                free(buffer);
-                buffer = NULL;
-            }
-
-            if (out->worker_exit) {
-                pthread_mutex_unlock(&out->lock);
-                break;
-            }
-
-            close_pcm = false;
+// Must be called with out->lock held
+static void out_publish_pull(struct generic_stream_out *out, uint64_t position,
+                             unsigned int frames) {
+    audio_seqlock_write_begin(&out->position_lock);
+    atomic_store_explicit(&out->pull_position, position, memory_order_relaxed);
+    atomic_store_explicit(&out->pull_consumed, out->frames_consumed, memory_order_relaxed);
+    atomic_store_explicit(&out->pull_frames, frames, memory_order_relaxed);
+    audio_seqlock_write_end(&out->position_lock);
+    out->frames_consumed += frames;
+}
 
-            pthread_mutex_lock(&out->dev->lock);
-            if (out->device == AUDIO_DEVICE_OUT_BLUETOOTH_SCO) {
-                out->dev->hfp_call.stream_flag |= HFP_OUT_ACTIVE_FLAG;
-            }
-            pthread_mutex_unlock(&out->dev->lock);
+// Output engine pull callback. Runs on the engine thread of out->ext_pcm.
+static int out_engine_pull(void *cookie, int32_t *mix, unsigned int frame_count,
+                           uint64_t position) {
+    struct generic_stream_out *out = (struct generic_stream_out *)cookie;
+    const int16_t *output_buffer;
+    size_t frames;
 
-            pthread_cond_wait(&out->worker_wake, &out->lock);
-        }
+    pthread_mutex_lock(&out->lock);
+    if ((out->standby && !out->draining) || out->paused) {
+        pthread_mutex_unlock(&out->lock);
+        return -ENODATA;
+    }
 
-        if (out->worker_exit) {
-            pthread_mutex_unlock(&out->lock);
-            break;
+    if (out->resampler && !out->batched) {
+        size_t in_frames_count = audio_vbuffer_read(&out->buffer, out->period_buffer,
+                (frame_count * out->req_config.sample_rate) / out->pcm_config.rate);
+        frames = 0;
+        if (in_frames_count > 0) {
+            frames = frame_count;
+            out->resampler->resample_from_input(out->resampler, (int16_t *)out->period_buffer,
+                    &in_frames_count, (int16_t *)out->resampler_buffer, &frames);
         }
+        output_buffer = out->resampler_buffer;
+    } else {
+        frames = audio_vbuffer_read(&out->buffer, out->period_buffer, frame_count);
+        output_buffer = out->period_buffer;
+    }
 
-        if (!ext_pcm) {
-            unsigned int card = PCM_CARD_DEFAULT;
-            unsigned int device = PCM_DEVICE_DEFAULT;
-            unsigned int flags = PCM_OUT | PCM_MONOTONIC;
-            if (out->device == AUDIO_DEVICE_OUT_BLUETOOTH_SCO) {
-                card = PCM_CARD_HFP;
-                device = PCM_DEVICE_HFP;
-                flags = PCM_OUT;
-                ext_pcm = ext_pcm_open_hfp(card, device, flags, &out->pcm_config);
-            } else {
-                ext_pcm = ext_pcm_open_default(card, device, flags, &out->pcm_config);
-            }
-
-            if (!ext_pcm_is_ready(ext_pcm)) {
-                ALOGE("pcm_open(out) failed: %s: address %s channels %d format %d rate %d period size %d",
-                        ext_pcm_get_error(ext_pcm),
-                        out->bus_address,
-                        out->pcm_config.channels,
-                        out->pcm_config.format,
-                        out->pcm_config.rate,
-                        out->pcm_config.period_size);
-                pthread_mutex_unlock(&out->lock);
-                break;
-            }
-            buffer_frames = out->pcm_config.period_size;
-            buffer_size = ext_pcm_frames_to_bytes(ext_pcm, buffer_frames);
-            buffer = malloc(buffer_size);
-            if (!buffer) {
-                ALOGE("could not allocate write buffer");
-                pthread_mutex_unlock(&out->lock);
-                break;
-            }
-        }
+    if ((out->batched || out->write_blocked) &&
+        audio_vbuffer_dead(&out->buffer) >= out->buffer.frame_count / 2) {
+        // Room for the next batch or the next client write
+        pthread_cond_signal(&out->worker_wake);
+    }
 
-        void *output_buffer;
-        int frames = audio_vbuffer_read(&out->buffer, buffer, buffer_frames);
-        ALOGV("%s: read %d frames from vbuffer", __func__, frames);
-
-        if (out->resampler) {
-            size_t in_frames_count = frames;
-            size_t out_frames_count = (frames * out->pcm_config.rate) / out->req_config.sample_rate;
-            out->resampler->resample_from_input(out->resampler, (int16_t*)buffer, &in_frames_count,
-                                               (int16_t*)out->resampler_buffer, &out_frames_count);
-            output_buffer = out->resampler_buffer;
-            frames = out_frames_count;
-        } else {
-            output_buffer = buffer;
+    if (out->draining && frames == 0) {
+        // The tail is in the PCM now; contribute silence so the engine keeps
+        // writing until it has gone through the whole ALSA buffer
+        if (out->drain_periods > 0) {
+            out->drain_periods -= 1;
+            pthread_mutex_unlock(&out->lock);
+            return frame_count;
         }
-
+        out_drain_complete(out);
         pthread_mutex_unlock(&out->lock);
-        int write_error = ext_pcm_write(ext_pcm, out->bus_address,
-                                        output_buffer, ext_pcm_frames_to_bytes(ext_pcm, frames));
-        if (write_error) {
-            ALOGE("pcm_write failed %s address %s", ext_pcm_get_error(ext_pcm), out->bus_address);
-            close_pcm = true;
-        } else {
-            ALOGV("pcm_write succeed address %s", out->bus_address);
-        }
+        return -ENODATA;
     }
 
-    return NULL;
+    const size_t samples = frames * out->pcm_config.channels;
+    for (size_t i = 0; i < samples; i++) {
+        mix[i] += output_buffer[i];
+    }
+    if (frames > 0) {
+        out_publish_pull(out, position, frames);
+    }
+    pthread_mutex_unlock(&out->lock);
+
+    ALOGV("%s: mixed %zu frames address %s", __func__, frames, out->bus_address);
+    return frames;
 }
 
 // Call with in->lock held
@@ -530,7 +836,7 @@ static void get_current_output_position(struct generic_stream_out *out,
         *timestamp = curtime;
     }
     int64_t position_since_underrun;
-    if (out->standby) {
+    if (out->standby || out->paused) {
         position_since_underrun = 0;
     } else {
         const int64_t first_us = (out->underrun_time.tv_sec * 1000000000LL +
@@ -558,29 +864,82 @@ static void get_current_output_position(struct generic_stream_out *out,
     }
 }
 
-// Applies gain naively, assume AUDIO_FORMAT_PCM_16_BIT
-static void out_apply_gain(struct generic_stream_out *out, const void *buffer, size_t bytes) {
+// Applies a Q15 gain, assume AUDIO_FORMAT_PCM_16_BIT
+static void out_apply_gain(int32_t gain_q15, const void *buffer, size_t bytes) {
     int16_t *int16_buffer = (int16_t *)buffer;
     size_t int16_size = bytes / sizeof(int16_t);
-    for (int i = 0; i < int16_size; i++) {
-        float multiplied = int16_buffer[i] * out->amplitude_ratio;
+    if (gain_q15 == GAIN_Q15_UNITY) {
+        // Buses with codec volume never leave unity
+        return;
+    }
+    for (size_t i = 0; i < int16_size; i++) {
+        const int32_t multiplied = (int16_buffer[i] * gain_q15) >> 15;
         if (multiplied > INT16_MAX) int16_buffer[i] = INT16_MAX;
         else if (multiplied < INT16_MIN) int16_buffer[i] = INT16_MIN;
         else int16_buffer[i] = (int16_t)multiplied;
     }
 }
 
+// Batched write, never blocks. Queues what fits and owes the client a
+// WRITE_READY if that was not everything.
+static ssize_t out_write_batched(struct generic_stream_out *out, const void *buffer,
+                                 size_t bytes) {
+    const size_t frame_size = audio_stream_out_frame_size(&out->stream);
+    const size_t frames = bytes / frame_size;
+    const int requested_channels = popcount(out->req_config.channel_mask);
+    size_t frames_written;
+
+    pthread_mutex_lock(&out->lock);
+    if (out->standby) {
+        out->standby = false;
+        out->draining = false;
+        clock_gettime(CLOCK_MONOTONIC, &out->underrun_time);
+        out->frames_rendered = 0;
+        out->frames_total_buffered = 0;
+    }
+
+    if (out->pcm_config.channels == requested_channels) {
+        frames_written = audio_vbuffer_write(&out->batch_queue, buffer, frames);
+    } else {
+        frames_written = audio_vbuffer_write_adjust(&out->batch_queue, buffer, frames,
+                                                    requested_channels);
+    }
+    out->write_blocked = frames_written < frames;
+    out->frames_written += frames_written;
+    out->frames_rendered += frames_written;
+    out->frames_total_buffered += frames_written;
+    pthread_cond_signal(&out->worker_wake);
+    pthread_mutex_unlock(&out->lock);
+
+    ALOGV("%s: queued %zu of %zu frames", __func__, frames_written, frames);
+    return frames_written * frame_size;
+}
+
 static ssize_t out_write(struct audio_stream_out *stream, const void *buffer, size_t bytes) {
     struct generic_stream_out *out = (struct generic_stream_out *)stream;
-    const size_t frames =  bytes / audio_stream_out_frame_size(stream);
+    size_t frames =  bytes / audio_stream_out_frame_size(stream);
 
     ALOGV("%s: bytes %zu, frames %zu", __func__, bytes, frames);
+    if (out->mmap) {
+        // The client writes the shared buffer directly
+        return -ENOSYS;
+    }
+    if (out->batched) {
+        return out_write_batched(out, buffer, bytes);
+    }
     pthread_mutex_lock(&out->lock);
 
-    if (out->worker_standby) {
-        out->worker_standby = false;
+    // A callback makes the stream non-blocking: take what fits now and post
+    // WRITE_READY once the engine has freed half of the vbuffer
+    const bool non_blocking = out->callback != NULL;
+    if (non_blocking) {
+        const size_t frames_free = audio_vbuffer_dead(&out->buffer);
+        out->write_blocked = frames_free < frames;
+        if (out->write_blocked) {
+            frames = frames_free;
+            bytes = frames * audio_stream_out_frame_size(stream);
+        }
     }
-    pthread_cond_signal(&out->worker_wake);
 
     uint64_t current_position;
     struct timespec current_time;
@@ -590,35 +949,46 @@ static ssize_t out_write(struct audio_stream_out *stream, const void *buffer, si
                              current_time.tv_nsec) / 1000;
     if (out->standby) {
         out->standby = false;
+        out->draining = false;
         out->underrun_time = current_time;
         out->frames_rendered = 0;
         out->frames_total_buffered = 0;
     }
 
-    //apply gain
-    out_apply_gain(out, buffer, bytes);
+    //apply gain, master mute still goes through the engine to keep the
+    //presentation position running
+    out_apply_gain(out->dev->master_mute ? 0 : out->gain_q15, buffer, bytes);
 
     // write to vbuffer
-    size_t frames_written = frames;
-    if (out->dev->master_mute) {
-        ALOGV("%s: ignored due to master mute", __func__);
-    } else {
-        const int requested_channels = popcount(out->req_config.channel_mask);
-
-        if (out->pcm_config.channels == requested_channels) {
-            frames_written = audio_vbuffer_write(&out->buffer, buffer, frames);
-        } else {
-            frames_written = audio_vbuffer_write_adjust(&out->buffer, buffer, frames, requested_channels);
-        }
+    size_t frames_written;
+    const int requested_channels = popcount(out->req_config.channel_mask);
 
-        pthread_cond_signal(&out->worker_wake);
+    if (out->pcm_config.channels == requested_channels) {
+        frames_written = audio_vbuffer_write(&out->buffer, buffer, frames);
+    } else {
+        frames_written = audio_vbuffer_write_adjust(&out->buffer, buffer, frames,
+                                                    requested_channels);
+    }
+    if (frames_written < frames) {
+        // Dropped frames never reach the engine, account for them as played
+        out->frames_consumed += ((frames - frames_written) * out->pcm_config.rate) /
+                                out->req_config.sample_rate;
     }
 
+    ext_pcm_kick(out->ext_pcm);
+
     /* Implementation just consumes bytes if we start getting backed up */
     out->frames_written += frames;
     out->frames_rendered += frames;
     out->frames_total_buffered += frames;
 
+    if (non_blocking) {
+        // The engine paces the client through WRITE_READY
+        out->last_write_time_us = now_us;
+        pthread_mutex_unlock(&out->lock);
+        return bytes;
+    }
+
     // We simulate the audio device blocking when it's write buffers become
     // full.
 
@@ -653,6 +1023,48 @@ static ssize_t out_write(struct audio_stream_out *stream, const void *buffer, si
     return bytes;
 }
 
+// Presentation position from the hardware timestamp the engine took after its
+// last write. Lock-free, fails until the engine has written for this stream.
+static int out_get_hw_position(struct generic_stream_out *out,
+        uint64_t *frames, struct timespec *timestamp) {
+    uint64_t written;
+    unsigned int queued;
+    if (!out->ext_pcm || ext_pcm_get_position(out->ext_pcm, &written, &queued, timestamp) != 0) {
+        return -ENODATA;
+    }
+    const uint64_t presented = written > queued ? written - queued : 0;
+
+    uint64_t pull_position, pull_consumed, consumed_base;
+    unsigned int pull_frames;
+    unsigned int seq;
+    do {
+        seq = audio_seqlock_read_begin(&out->position_lock);
+        pull_position = atomic_load_explicit(&out->pull_position, memory_order_relaxed);
+        pull_consumed = atomic_load_explicit(&out->pull_consumed, memory_order_relaxed);
+        pull_frames = atomic_load_explicit(&out->pull_frames, memory_order_relaxed);
+        consumed_base = atomic_load_explicit(&out->consumed_base, memory_order_relaxed);
+    } while (audio_seqlock_read_retry(&out->position_lock, seq));
+    if (pull_frames == 0) {
+        return -ENODATA;
+    }
+
+    // Frames of the stream pulled before the last pull are assumed to sit
+    // right in front of it in the PCM
+    uint64_t consumed;
+    if (presented >= pull_position + pull_frames) {
+        consumed = pull_consumed + pull_frames;
+    } else if (presented >= pull_position) {
+        consumed = pull_consumed + (presented - pull_position);
+    } else if (pull_consumed > pull_position - presented) {
+        consumed = pull_consumed - (pull_position - presented);
+    } else {
+        consumed = 0;
+    }
+    consumed = consumed > consumed_base ? consumed - consumed_base : 0;
+    *frames = (consumed * out->req_config.sample_rate) / out->pcm_config.rate;
+    return 0;
+}
+
 static int out_get_presentation_position(const struct audio_stream_out *stream,
         uint64_t *frames, struct timespec *timestamp) {
     if (stream == NULL || frames == NULL || timestamp == NULL) {
@@ -660,6 +1072,11 @@ static int out_get_presentation_position(const struct audio_stream_out *stream,
     }
     struct generic_stream_out *out = (struct generic_stream_out *)stream;
 
+    if (out_get_hw_position(out, frames, timestamp) == 0) {
+        return 0;
+    }
+
+    // No hardware position yet, estimate
     pthread_mutex_lock(&out->lock);
     get_current_output_position(out, frames, timestamp);
     pthread_mutex_unlock(&out->lock);
@@ -678,30 +1095,41 @@ static int out_get_render_position(const struct audio_stream_out *stream, uint32
     return 0;
 }
 
-// Must be called with out->lock held
+// Must be called with out->lock held. Does not wait for the buffered frames,
+// the engine keeps pulling the stream until they have been played out and
+// then calls out_drain_complete().
 static void do_out_standby(struct generic_stream_out *out) {
-    int frames_sleep = 0;
-    uint64_t sleep_time_us = 0;
+    if (out->mmap) {
+        audio_mmap_stop(out->mmap);
+        out->standby = true;
+        return;
+    }
     if (out->standby) {
+        if (out->device == AUDIO_DEVICE_OUT_BLUETOOTH_SCO && !out->draining) {
+            hfp_stream_parked(out->dev, HFP_OUT_ACTIVE_FLAG);
+        }
         return;
     }
-    while (true) {
+    if (out->paused) {
+        // Paused frames are stale, only what the engine holds plays out.
+        // out_pause() already froze the position estimate.
+        audio_vbuffer_flush(&out->buffer);
+        out->paused = false;
+    } else {
+        // Freeze the estimate like out_pause() does, the next write resumes
+        // it from there so it neither skips ahead nor goes backwards
         get_current_output_position(out, &out->underrun_position, NULL);
-        frames_sleep = out->frames_written - out->underrun_position;
-        if (frames_sleep == 0) {
-            break;
-        }
-
-        sleep_time_us = frames_sleep * 1000000LL /
-                        out_get_sample_rate(&out->stream.common);
-
-        pthread_mutex_unlock(&out->lock);
-        usleep(sleep_time_us);
-        pthread_mutex_lock(&out->lock);
     }
-    out->worker_standby = true;
+    if (out->batched) {
+        // Queued but not yet converted frames are dropped
+        audio_vbuffer_flush(&out->batch_queue);
+        out->batch_generation++;
+        out->write_blocked = false;
+    }
     out->standby = true;
-    pthread_cond_signal(&out->worker_wake);
+    out->draining = true;
+    out->drain_periods = out->pcm_config.period_count;
+    ext_pcm_kick(out->ext_pcm);
 }
 
 static int out_standby(struct audio_stream *stream) {
@@ -712,62 +1140,351 @@ static int out_standby(struct audio_stream *stream) {
     return 0;
 }
 
-static int out_add_audio_effect(const struct audio_stream *stream, effect_handle_t effect) {
-    // out_add_audio_effect is a no op
-    return 0;
-}
+static void *out_worker(void *args);
 
-static int out_remove_audio_effect(const struct audio_stream *stream, effect_handle_t effect) {
-    // out_remove_audio_effect is a no op
-    return 0;
+// Must be called with out->lock held
+static int out_start_worker(struct generic_stream_out *out) {
+    if (out->worker_running) {
+        return 0;
+    }
+    int ret = audio_thread_create(&out->worker_thread, &out_worker_thread_config,
+                                  out->bus_address, out_worker, out);
+    if (ret == 0) {
+        out->worker_running = true;
+    }
+    return ret;
 }
 
-static int out_get_next_write_timestamp(const struct audio_stream_out *stream,
-        int64_t *timestamp) {
-    return -ENOSYS;
+// Makes write and drain non-blocking, see out_write() and out_drain().
+// Batched streams already have a worker, the others get one now to post
+// the events.
+static int out_set_callback(struct audio_stream_out *stream, stream_callback_t callback,
+                            void *cookie) {
+    struct generic_stream_out *out = (struct generic_stream_out *)stream;
+    pthread_mutex_lock(&out->lock);
+    out->callback = callback;
+    out->callback_cookie = cookie;
+    int ret = out_start_worker(out);
+    pthread_mutex_unlock(&out->lock);
+    return ret;
 }
 
-static uint32_t in_get_sample_rate(const struct audio_stream *stream) {
-    struct generic_stream_in *in = (struct generic_stream_in *)stream;
-    return in->req_config.sample_rate;
+// Keeps everything queued and the PCM open, the engine stops pulling the
+// stream and its position freezes until out_resume()
+static int out_pause(struct audio_stream_out *stream) {
+    struct generic_stream_out *out = (struct generic_stream_out *)stream;
+    pthread_mutex_lock(&out->lock);
+    if (!out->paused && !out->standby) {
+        get_current_output_position(out, &out->underrun_position, NULL);
+        out->paused = true;
+    }
+    pthread_mutex_unlock(&out->lock);
+    return 0;
 }
 
-static int in_set_sample_rate(struct audio_stream *stream, uint32_t rate) {
-    return -ENOSYS;
+static int out_resume(struct audio_stream_out *stream) {
+    struct generic_stream_out *out = (struct generic_stream_out *)stream;
+    pthread_mutex_lock(&out->lock);
+    if (out->paused) {
+        out->paused = false;
+        clock_gettime(CLOCK_MONOTONIC, &out->underrun_time);
+        if (out->worker_running) {
+            pthread_cond_signal(&out->worker_wake);
+        }
+        ext_pcm_kick(out->ext_pcm);
+    }
+    pthread_mutex_unlock(&out->lock);
+    return 0;
 }
 
-static int refine_output_parameters(uint32_t *sample_rate, audio_format_t *format,
-        audio_channel_mask_t *channel_mask) {
-    static const uint32_t sample_rates [] = {
-        8000, 11025, 16000, 22050, 24000, 32000, 44100, 48000
-    };
-    static const int sample_rates_count = sizeof(sample_rates)/sizeof(uint32_t);
-    bool inval = false;
-    if (*format != AUDIO_FORMAT_PCM_16_BIT) {
-        *format = AUDIO_FORMAT_PCM_16_BIT;
-        inval = true;
+// Completes once the engine has played out the last frame queued, early
+// notification is not distinguished. With a callback DRAIN_READY is posted
+// by the worker, otherwise this blocks.
+static int out_drain(struct audio_stream_out *stream, audio_drain_type_t type) {
+    struct generic_stream_out *out = (struct generic_stream_out *)stream;
+    int ret = 0;
+    pthread_mutex_lock(&out->lock);
+    if (out->standby && !out->draining) {
+        if (out->worker_running) {
+            out->drain_ready = true;
+            pthread_cond_signal(&out->worker_wake);
+        }
+        pthread_mutex_unlock(&out->lock);
+        return 0;
     }
 
-    int channel_count = popcount(*channel_mask);
-    if (channel_count != 1 && channel_count != 2) {
-        *channel_mask = AUDIO_CHANNEL_IN_STEREO;
-        inval = true;
+    out->drain_requested = true;
+    if (out->batched) {
+        // The worker hands over the tail once batch_queue is empty
+        pthread_cond_signal(&out->worker_wake);
+    } else if (!out->draining) {
+        out->draining = true;
+        out->drain_periods = out->pcm_config.period_count;
+        ext_pcm_kick(out->ext_pcm);
     }
 
-    int i;
-    for (i = 0; i < sample_rates_count; i++) {
-        if (*sample_rate < sample_rates[i]) {
-            *sample_rate = sample_rates[i];
-            inval=true;
-            break;
-        }
-        else if (*sample_rate == sample_rates[i]) {
-            break;
+    if (!out->worker_running) {
+        // Bounded in case the stream is paused or the engine stalls
+        const unsigned int queued = audio_vbuffer_live(&out->buffer) +
+                (out->batched ? audio_vbuffer_live(&out->batch_queue) : 0) +
+                out->pcm_config.period_size * out->pcm_config.period_count;
+        const int64_t timeout_ms = 2 * (queued * 1000LL) / out->pcm_config.rate + 100;
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += timeout_ms * 1000000LL;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000LL;
+        deadline.tv_nsec %= 1000000000LL;
+        while (out->drain_requested && ret == 0) {
+            ret = pthread_cond_timedwait(&out->drained, &out->lock, &deadline);
         }
-        else if (i == sample_rates_count-1) {
-            // Cap it to the highest rate we support
-            *sample_rate = sample_rates[i];
-            inval=true;
+        if (ret == ETIMEDOUT) {
+            ALOGW("%s: timed out, address %s", __func__, out->bus_address);
+            out->drain_requested = false;
+            ret = -ETIMEDOUT;
+        }
+    }
+    pthread_mutex_unlock(&out->lock);
+    return ret;
+}
+
+// Drops everything the stream has queued and restarts its position from 0.
+// Frames the engine has already mixed into the shared PCM still play.
+static int out_flush(struct audio_stream_out *stream) {
+    struct generic_stream_out *out = (struct generic_stream_out *)stream;
+    pthread_mutex_lock(&out->lock);
+    audio_vbuffer_flush(&out->buffer);
+    if (out->batched) {
+        audio_vbuffer_flush(&out->batch_queue);
+        out->batch_generation++;
+    } else if (out->resampler) {
+        out->resampler->reset(out->resampler);
+    }
+    out->standby = true;
+    out->paused = false;
+    out->draining = false;
+    out->write_blocked = false;
+    if (out->drain_requested) {
+        // Nothing left to drain, release a blocked out_drain()
+        out->drain_requested = false;
+        pthread_cond_broadcast(&out->drained);
+    }
+    out->underrun_position = 0;
+    out->frames_written = 0;
+    out->frames_rendered = 0;
+    out->frames_total_buffered = 0;
+    audio_seqlock_write_begin(&out->position_lock);
+    atomic_store_explicit(&out->consumed_base, out->frames_consumed, memory_order_relaxed);
+    audio_seqlock_write_end(&out->position_lock);
+    pthread_mutex_unlock(&out->lock);
+    return 0;
+}
+
+// Posts the stream callbacks, which must not be called from the engine. For
+// batched streams also feeds the engine: wakes up once half of out->buffer is
+// free, converts a whole batch from batch_queue (gain, resampling) and goes
+// back to sleep, so the client and this thread run seldom and in bulk.
+static void *out_worker(void *args) {
+    struct generic_stream_out *out = (struct generic_stream_out *)args;
+    const size_t batch_frames = out->buffer.frame_count / 2;
+    const size_t batch_in_frames = out->resampler ?
+            (batch_frames * out->req_config.sample_rate) / out->pcm_config.rate : batch_frames;
+    // What the client writes into
+    audio_vbuffer_t *queue = out->batched ? &out->batch_queue : &out->buffer;
+    unsigned int generation = 0;
+
+    pthread_mutex_lock(&out->lock);
+    generation = out->batch_generation;
+    while (!out->worker_exit) {
+        stream_callback_event_t event;
+        bool post = false;
+        if (out->drain_ready) {
+            out->drain_ready = false;
+            event = STREAM_CBK_EVENT_DRAIN_READY;
+            post = true;
+        } else if (out->write_blocked &&
+                   audio_vbuffer_dead(queue) >= queue->frame_count / 2) {
+            out->write_blocked = false;
+            event = STREAM_CBK_EVENT_WRITE_READY;
+            post = true;
+        }
+        if (post) {
+            stream_callback_t callback = out->callback;
+            void *cookie = out->callback_cookie;
+            // The client may call back into the stream
+            pthread_mutex_unlock(&out->lock);
+            if (callback) {
+                callback(event, NULL, cookie);
+            }
+            pthread_mutex_lock(&out->lock);
+            continue;
+        }
+
+        size_t frames = 0;
+        if (out->batched && !out->standby && !out->paused &&
+            audio_vbuffer_dead(&out->buffer) >= batch_frames) {
+            frames = audio_vbuffer_read(&out->batch_queue, out->batch,
+                                        batch_in_frames);
+        }
+        if (frames > 0) {
+            if (generation != out->batch_generation) {
+                generation = out->batch_generation;
+                if (out->resampler) {
+                    out->resampler->reset(out->resampler);
+                }
+            }
+            const int32_t gain_q15 = out->dev->master_mute ? 0 : out->gain_q15;
+            pthread_mutex_unlock(&out->lock);
+
+            out_apply_gain(gain_q15, out->batch,
+                           frames * out->batch_queue.frame_size);
+            const void *converted = out->batch;
+            size_t converted_frames = frames;
+            if (out->resampler) {
+                converted_frames = batch_frames;
+                out->resampler->resample_from_input(out->resampler,
+                        (int16_t *)out->batch, &frames,
+                        (int16_t *)out->batch_resampled, &converted_frames);
+                converted = out->batch_resampled;
+            }
+
+            pthread_mutex_lock(&out->lock);
+            // Dropped if flushed meanwhile
+            if (generation == out->batch_generation) {
+                audio_vbuffer_write(&out->buffer, converted, converted_frames);
+                ext_pcm_kick(out->ext_pcm);
+            }
+            continue;
+        }
+
+        if (out->batched && out->drain_requested && !out->draining && !out->paused &&
+            audio_vbuffer_live(&out->batch_queue) == 0) {
+            // Everything is with the engine now, see out_drain_complete()
+            out->draining = true;
+            out->drain_periods = out->pcm_config.period_count;
+            ext_pcm_kick(out->ext_pcm);
+        }
+        pthread_cond_wait(&out->worker_wake, &out->lock);
+    }
+    pthread_mutex_unlock(&out->lock);
+
+    return NULL;
+}
+
+static int out_start(const struct audio_stream_out *stream) {
+    struct generic_stream_out *out = (struct generic_stream_out *)stream;
+    pthread_mutex_lock(&out->lock);
+    int ret = audio_mmap_start(out->mmap);
+    if (ret == 0) {
+        out->standby = false;
+    }
+    pthread_mutex_unlock(&out->lock);
+    return ret;
+}
+
+static int out_stop(const struct audio_stream_out *stream) {
+    struct generic_stream_out *out = (struct generic_stream_out *)stream;
+    pthread_mutex_lock(&out->lock);
+    int ret = audio_mmap_stop(out->mmap);
+    pthread_mutex_unlock(&out->lock);
+    return ret;
+}
+
+static int out_create_mmap_buffer(const struct audio_stream_out *stream,
+        int32_t min_size_frames, struct audio_mmap_buffer_info *info) {
+    struct generic_stream_out *out = (struct generic_stream_out *)stream;
+    pthread_mutex_lock(&out->lock);
+    int ret = audio_mmap_create_buffer(out->mmap, min_size_frames, info);
+    pthread_mutex_unlock(&out->lock);
+    return ret;
+}
+
+static int out_get_mmap_position(const struct audio_stream_out *stream,
+        struct audio_mmap_position *position) {
+    struct generic_stream_out *out = (struct generic_stream_out *)stream;
+    if (position == NULL) {
+        return -EINVAL;
+    }
+    pthread_mutex_lock(&out->lock);
+    int ret = audio_mmap_get_position(out->mmap, position);
+    pthread_mutex_unlock(&out->lock);
+    return ret;
+}
+
+static int out_add_audio_effect(const struct audio_stream *stream, effect_handle_t effect) {
+    // out_add_audio_effect is a no op
+    return 0;
+}
+
+static int out_remove_audio_effect(const struct audio_stream *stream, effect_handle_t effect) {
+    // out_remove_audio_effect is a no op
+    return 0;
+}
+
+// When a frame written now would be presented, in microseconds
+static int out_get_next_write_timestamp(const struct audio_stream_out *stream,
+        int64_t *timestamp) {
+    struct generic_stream_out *out = (struct generic_stream_out *)stream;
+    uint64_t written;
+    unsigned int queued;
+    struct timespec hw_time;
+    if (out->mmap || ext_pcm_get_position(out->ext_pcm, &written, &queued, &hw_time) != 0) {
+        return -ENOSYS;
+    }
+
+    const uint32_t pcm_rate = out->pcm_config.rate;
+    // Batched streams are resampled before out->buffer, the others after
+    int64_t queued_us = (queued * 1000000LL) / pcm_rate +
+            (audio_vbuffer_live(&out->buffer) * 1000000LL) /
+            (out->batched ? pcm_rate : out->req_config.sample_rate);
+    if (out->batched) {
+        queued_us += (audio_vbuffer_live(&out->batch_queue) * 1000000LL) /
+                out->req_config.sample_rate;
+    }
+    *timestamp = (hw_time.tv_sec * 1000000000LL + hw_time.tv_nsec) / 1000 + queued_us;
+    return 0;
+}
+
+static uint32_t in_get_sample_rate(const struct audio_stream *stream) {
+    struct generic_stream_in *in = (struct generic_stream_in *)stream;
+    return in->req_config.sample_rate;
+}
+
+static int in_set_sample_rate(struct audio_stream *stream, uint32_t rate) {
+    return -ENOSYS;
+}
+
+static int refine_output_parameters(uint32_t *sample_rate, audio_format_t *format,
+        audio_channel_mask_t *channel_mask) {
+    static const uint32_t sample_rates [] = {
+        8000, 11025, 16000, 22050, 24000, 32000, 44100, 48000
+    };
+    static const int sample_rates_count = sizeof(sample_rates)/sizeof(uint32_t);
+    bool inval = false;
+    if (*format != AUDIO_FORMAT_PCM_16_BIT) {
+        *format = AUDIO_FORMAT_PCM_16_BIT;
+        inval = true;
+    }
+
+    int channel_count = popcount(*channel_mask);
+    if (channel_count != 1 && channel_count != 2) {
+        *channel_mask = AUDIO_CHANNEL_IN_STEREO;
+        inval = true;
+    }
+
+    int i;
+    for (i = 0; i < sample_rates_count; i++) {
+        if (*sample_rate < sample_rates[i]) {
+            *sample_rate = sample_rates[i];
+            inval=true;
+            break;
+        }
+        else if (*sample_rate == sample_rates[i]) {
+            break;
+        }
+        else if (i == sample_rates_count-1) {
+            // Cap it to the highest rate we support
+            *sample_rate = sample_rates[i];
+            inval=true;
         }
     }
 
@@ -789,8 +1506,19 @@ static int refine_input_parameters(uint32_t *sample_rate, audio_format_t *format
         inval = true;
     }
 
-    int channel_count = popcount(*channel_mask);
-    if (channel_count != 1 && channel_count != 2) {
+    const uint32_t channel_count = audio_channel_count_from_in_mask(*channel_mask);
+    if (audio_channel_mask_get_representation(*channel_mask) ==
+            AUDIO_CHANNEL_REPRESENTATION_INDEX) {
+        // The first channels of the microphone PCM as they are captured
+        const uint32_t max_channels = platform.in_default.config->channels;
+        if (channel_count == 0 || channel_count > max_channels ||
+            *channel_mask != audio_channel_mask_for_index_assignment_from_count(channel_count)) {
+            *channel_mask = audio_channel_mask_for_index_assignment_from_count(
+                    channel_count == 0 || channel_count > max_channels ?
+                    max_channels : channel_count);
+            inval = true;
+        }
+    } else if (channel_count != 1 && channel_count != 2) {
         *channel_mask = AUDIO_CHANNEL_IN_STEREO;
         inval = true;
     }
@@ -821,7 +1549,7 @@ static int refine_input_parameters(uint32_t *sample_rate, audio_format_t *format
 static size_t get_input_buffer_size(uint32_t sample_rate, audio_format_t format,
         audio_channel_mask_t channel_mask) {
     size_t size;
-    int channel_count = popcount(channel_mask);
+    const uint32_t channel_count = audio_channel_count_from_in_mask(channel_mask);
     if (refine_input_parameters(&sample_rate, &format, &channel_mask) != 0)
         return 0;
 
@@ -835,6 +1563,9 @@ static size_t get_input_buffer_size(uint32_t sample_rate, audio_format_t format,
 
 static size_t in_get_buffer_size(const struct audio_stream *stream) {
     struct generic_stream_in *in = (struct generic_stream_in *)stream;
+    if (in->mmap) {
+        return in->pcm_config.period_size * audio_stream_in_frame_size(&in->stream);
+    }
     int size = get_input_buffer_size(in->req_config.sample_rate,
                                  in->req_config.format,
                                  in->req_config.channel_mask);
@@ -934,7 +1665,7 @@ static char *in_get_parameters(const struct audio_stream *stream, const char *ke
     } else if (str_parms_get_str(query, AUDIO_PARAMETER_STREAM_SUP_SAMPLING_RATES,
             value, sizeof(value)) >= 0) {
         str_parms_add_int(reply, AUDIO_PARAMETER_STREAM_SUP_SAMPLING_RATES,
-                DEFAULT_IN_SAMPLING_RATE);
+                pcm_config_in_default.rate);
         str = strdup(str_parms_to_str(reply));
     } else if (str_parms_get_str(query, AUDIO_PARAMETER_STREAM_SUP_CHANNELS,
             value, sizeof(value)) >= 0) {
@@ -960,11 +1691,165 @@ static char *in_get_parameters(const struct audio_stream *stream, const char *ke
     return str;
 }
 
+// PCM an input captures from. Call with in->lock held.
+static void in_get_pcm_device(const struct generic_stream_in *in,
+        unsigned int *card, unsigned int *device) {
+    if (in->device == AUDIO_DEVICE_IN_FM_TUNER) {
+        *card = platform.in_fm.card;
+        *device = platform.in_fm.device;
+    } else if (in->device == AUDIO_DEVICE_IN_BLUETOOTH_SCO_HEADSET) {
+        *card = platform.in_hfp.card;
+        *device = platform.in_hfp.device;
+    } else {
+        *card = platform.in_default.card;
+        *device = platform.in_default.device;
+    }
+}
+
+// Whether frames captured from card and device go through the beamformer.
+// in_read_worker() and in_get_active_microphones() both decide through here
+// so the reported channel mapping always matches what the client receives.
+// Call with in->lock held.
+static bool in_beam_steered(const struct generic_stream_in *in,
+        unsigned int card, unsigned int device) {
+    return in->beamforming &&
+           card == platform.in_default.card && device == platform.in_default.device;
+}
+
+static int32_t amplitude_to_q15(float amplitude) {
+    const long q15 = lrintf(amplitude * GAIN_Q15_UNITY);
+    // Keeps sample * gain within int32
+    return q15 < 0 ? 0 : q15 >= 2 * GAIN_Q15_UNITY ? 2 * GAIN_Q15_UNITY - 1 : (int32_t)q15;
+}
+
+// Codec capture volume of a card, NULL if input gain is applied in software
+static struct capture_volume *find_capture_volume(const struct generic_audio_device *adev,
+        unsigned int card_id) {
+    for (const struct device_card *card = adev->device_cards;
+         card && card->card != UINT32_MAX; card++) {
+        if (card->card != card_id) {
+            continue;
+        }
+        for (struct capture_volume *volume = card->capture_volumes;
+             volume && volume->ctl_name; volume++) {
+            if (volume->ctl) {
+                return volume;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Call with adev->capture_volume_lock held
+static void capture_set_hw_volume(struct capture_volume *volume, float gain) {
+    const int min = mixer_ctl_get_range_min(volume->ctl);
+    const int max = mixer_ctl_get_range_max(volume->ctl);
+    const long scaled = lrintf(volume->unity * gain);
+    const int raw = scaled < min ? min : scaled > max ? max : (int)scaled;
+    const unsigned int num_values = mixer_ctl_get_num_values(volume->ctl);
+    for (unsigned int i = 0; i < num_values; i++) {
+        mixer_ctl_set_value(volume->ctl, i, raw);
+    }
+    volume->gain = gain;
+    ALOGD("%s: %s = %d", __func__, volume->ctl_name, raw);
+}
+
+// Counts an input that opened a PCM of card. The capture volume of the card
+// carries the input gain only while there is a single one, see
+// in_apply_gain(). Returns NULL if the card has no capture volume.
+static struct capture_volume *capture_volume_acquire(struct generic_audio_device *adev,
+        unsigned int card) {
+    pthread_mutex_lock(&adev->capture_volume_lock);
+    struct capture_volume *volume = find_capture_volume(adev, card);
+    if (volume && ++volume->users > 1 && volume->gain != 1.0f) {
+        // Shared from now on, every input applies its own gain
+        capture_set_hw_volume(volume, 1.0f);
+    }
+    pthread_mutex_unlock(&adev->capture_volume_lock);
+    return volume;
+}
+
+// Counts out an input that closed its PCM. The last one puts the control back
+// at 0 dB.
+static void capture_volume_release(struct generic_audio_device *adev,
+        struct capture_volume *volume) {
+    if (!volume) {
+        return;
+    }
+    pthread_mutex_lock(&adev->capture_volume_lock);
+    if (--volume->users == 0 && volume->ctl && volume->gain != 1.0f) {
+        capture_set_hw_volume(volume, 1.0f);
+    }
+    pthread_mutex_unlock(&adev->capture_volume_lock);
+}
+
+// The gain is an amplitude ratio. The worker applies it to the captured
+// frames, or hands it to the codec while the stream is the only input of a
+// card with a capture volume.
 static int in_set_gain(struct audio_stream_in *stream, float gain) {
-    // TODO(hwwang): support adjusting input gain
+    struct generic_stream_in *in = (struct generic_stream_in *)stream;
+    if (!(gain >= 0.0f)) {
+        return -EINVAL;
+    }
+    pthread_mutex_lock(&in->lock);
+    in->gain = gain;
+    in->gain_q15 = amplitude_to_q15(gain);
+    pthread_mutex_unlock(&in->lock);
     return 0;
 }
 
+// Applies the microphone trim, if mic_pcm, and the input gain to frames as
+// read from the PCM, before they are resampled or have channels dropped.
+// hw_volume is the capture volume of the card the PCM is on, if any. Call
+// with in->lock held.
+static void in_apply_gain(struct generic_stream_in *in, void *buffer, size_t frame_count,
+        bool mic_pcm, struct capture_volume *hw_volume) {
+    struct generic_audio_device *adev = in->dev;
+    const size_t channels = in->pcm_config.channels;
+    int32_t stream_gain_q15 = in->gain_q15;
+    if (hw_volume) {
+        pthread_mutex_lock(&adev->capture_volume_lock);
+        if (hw_volume->users == 1 && hw_volume->ctl) {
+            if (hw_volume->gain != in->gain) {
+                capture_set_hw_volume(hw_volume, in->gain);
+            }
+            stream_gain_q15 = GAIN_Q15_UNITY;
+        }
+        pthread_mutex_unlock(&adev->capture_volume_lock);
+    }
+    if (channels > MIC_TRIM_MAX_CHANNELS) {
+        out_apply_gain(stream_gain_q15, buffer, frame_count * channels * sizeof(int16_t));
+        return;
+    }
+
+    int32_t trim_q15[MIC_TRIM_MAX_CHANNELS];
+    if (mic_pcm) {
+        unsigned int seq;
+        do {
+            seq = audio_seqlock_read_begin(&adev->mic_trim_lock);
+            for (size_t ch = 0; ch < channels; ch++) {
+                trim_q15[ch] = atomic_load_explicit(&adev->mic_trim_q15[ch],
+                                                    memory_order_relaxed);
+            }
+        } while (audio_seqlock_read_retry(&adev->mic_trim_lock, seq));
+    } else {
+        for (size_t ch = 0; ch < channels; ch++) {
+            trim_q15[ch] = GAIN_Q15_UNITY;
+        }
+    }
+
+    int32_t gain_q15[MIC_TRIM_MAX_CHANNELS];
+    bool unity = true;
+    for (size_t ch = 0; ch < channels; ch++) {
+        const int32_t gain = ((int64_t)trim_q15[ch] * stream_gain_q15) >> 15;
+        gain_q15[ch] = gain >= 2 * GAIN_Q15_UNITY ? 2 * GAIN_Q15_UNITY - 1 : gain;
+        unity = unity && gain_q15[ch] == GAIN_Q15_UNITY;
+    }
+    if (!unity) {
+        audio_buffer_apply_channel_gain((int16_t *)buffer, channels, frame_count, gain_q15);
+    }
+}
+
 // Call with in->lock held
 static void get_current_input_position(struct generic_stream_in *in,
         int64_t * position, struct timespec * timestamp) {
@@ -992,6 +1877,11 @@ static void get_current_input_position(struct generic_stream_in *in,
 
 // Must be called with in->lock held
 static void do_in_standby(struct generic_stream_in *in) {
+    if (in->mmap) {
+        audio_mmap_stop(in->mmap);
+        in->standby = true;
+        return;
+    }
     if (in->standby) {
         return;
     }
@@ -1009,13 +1899,53 @@ static int in_standby(struct audio_stream *stream) {
     return 0;
 }
 
+// Stops capture but keeps the PCM of card and device open for up to
+// IN_WARM_STANDBY_MS. Returns true if the stream left standby in time, still
+// captures from that PCM and the PCM was prepared for reuse. Must be called
+// with in->lock held.
+static bool in_warm_standby(struct generic_stream_in *in, struct pcm *pcm,
+        unsigned int card, unsigned int device) {
+    if (IN_WARM_STANDBY_MS == 0 || in->worker_exit) {
+        return false;
+    }
+
+    pcm_stop(pcm);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_nsec += IN_WARM_STANDBY_MS * 1000000LL;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000LL;
+    deadline.tv_nsec %= 1000000000LL;
+
+    while (in->worker_standby && !in->worker_exit) {
+        if (pthread_cond_timedwait(&in->worker_wake, &in->lock, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    if (in->worker_standby || in->worker_exit) {
+        return false;
+    }
+    // Routing may only change in standby, which is this window
+    unsigned int current_card, current_device;
+    in_get_pcm_device(in, &current_card, &current_device);
+    if (current_card != card || current_device != device) {
+        return false;
+    }
+    return pcm_prepare(pcm) == 0;
+}
+
 static void *in_read_worker(void *args) {
     struct generic_stream_in *in = (struct generic_stream_in *)args;
     struct pcm *pcm = NULL;
-    uint8_t *buffer = NULL;
-    size_t buffer_frames;
-    int buffer_size;
+    uint8_t *buffer = in->period_buffer;
+    const size_t buffer_frames = in->pcm_config.period_size;
     bool close_pcm = false;
+    bool read_failed = false;
+    bool mic_pcm = false;
+    bool beam_steered = false;
+    unsigned int pcm_card = UINT32_MAX;
+    unsigned int pcm_device = UINT32_MAX;
+    struct capture_volume *hw_volume = NULL;
 
     while (true) {
         pthread_mutex_lock(&in->lock);
@@ -1031,13 +1961,19 @@ static void *in_read_worker(void *args) {
             }
         }
 
+        if (close_pcm && pcm && !read_failed &&
+                in_warm_standby(in, pcm, pcm_card, pcm_device)) {
+            ALOGV("%s: resuming warm input pcm", __func__);
+            close_pcm = false;
+        }
+
         if (close_pcm) {
             if (pcm) {
                 ALOGD("%s: closing input pcm", __func__);
                 pcm_close(pcm); // Frees pcm
                 pcm = NULL;
-                free(buffer);
-                buffer=NULL;
+                capture_volume_release(in->dev, hw_volume);
+                hw_volume = NULL;
             }
 
             if (in->worker_exit) {
@@ -1045,8 +1981,12 @@ static void *in_read_worker(void *args) {
                 break;
             }
 
+            // A stream re-routed during warm standby is already running again
+            if (in->worker_standby || read_failed) {
+                pthread_cond_wait(&in->worker_wake, &in->lock);
+            }
             close_pcm = false;
-            pthread_cond_wait(&in->worker_wake, &in->lock);
+            read_failed = false;
         }
 
         if (in->worker_exit) {
@@ -1056,18 +1996,14 @@ static void *in_read_worker(void *args) {
 
         if (!pcm) {
             ALOGD("%s: opening input pcm", __func__);
-            unsigned int card, device;
-            if (in->device == AUDIO_DEVICE_IN_FM_TUNER) {
-                card = PCM_CARD_FM;
-                device = PCM_DEVICE_FM;
-            } else if (in->device == AUDIO_DEVICE_IN_BLUETOOTH_SCO_HEADSET) {
-                card = PCM_CARD_HFP;
-                device = PCM_DEVICE_HFP;
-            } else {
-                card = PCM_CARD_DEFAULT;
-                device = PCM_DEVICE_DEFAULT;
+            in_get_pcm_device(in, &pcm_card, &pcm_device);
+            mic_pcm = pcm_card == platform.in_default.card &&
+                      pcm_device == platform.in_default.device;
+            beam_steered = in_beam_steered(in, pcm_card, pcm_device);
+            if (beam_steered) {
+                beamformer_reset(&in->beamformer);
             }
-            pcm = pcm_open(card, device, PCM_IN, &in->pcm_config);
+            pcm = pcm_open(pcm_card, pcm_device, PCM_IN, &in->pcm_config);
             if (!pcm_is_ready(pcm)) {
                 ALOGE("pcm_open(in) failed: %s: channels %d format %d rate %d period size %d",
                         pcm_get_error(pcm),
@@ -1078,14 +2014,7 @@ static void *in_read_worker(void *args) {
                 pthread_mutex_unlock(&in->lock);
                 break;
             }
-            buffer_frames = in->pcm_config.period_size;
-            buffer_size = pcm_frames_to_bytes(pcm, buffer_frames);
-            buffer = malloc(buffer_size);
-            if (!buffer) {
-                ALOGE("could not allocate worker read buffer");
-                pthread_mutex_unlock(&in->lock);
-                break;
-            }
+            hw_volume = capture_volume_acquire(in->dev, pcm_card);
         }
         pthread_mutex_unlock(&in->lock);
 
@@ -1094,12 +2023,18 @@ static void *in_read_worker(void *args) {
         if (ret != 0) {
             ALOGW("pcm_read failed %s", pcm_get_error(pcm));
             close_pcm = true;
+            read_failed = true;
         }
 
         ALOGV("%s: read %zu frames from input pcm", __func__, buffer_frames);
 
         size_t frames_written = 0;
         pthread_mutex_lock(&in->lock);
+        in_apply_gain(in, buffer, buffer_frames, mic_pcm, hw_volume);
+        if (beam_steered) {
+            beamformer_process(&in->beamformer, (int16_t *)buffer, buffer_frames,
+                               audio_channel_count_from_in_mask(in->req_config.channel_mask));
+        }
         if (in->resampler) {
             size_t in_frames_count = buffer_frames;
             size_t out_frames_count = (buffer_frames * in->req_config.sample_rate) / in->pcm_config.rate;
@@ -1121,23 +2056,63 @@ static void *in_read_worker(void *args) {
     return NULL;
 }
 
+static int32_t hfp_volume_to_gain(unsigned int volume) {
+    if (volume == 0) {
+        return 0;
+    }
+    float db = -(float)(HFP_VOLUME_MAX - volume) * HFP_VOLUME_STEP_DB;
+    return (int32_t)(GAIN_Q15_UNITY * powf(10, db / 20));
+}
+
+// Copies the upper half of each SCO frame over the lower half, where the
+// call audio is not delivered, and applies the call volume in the same pass.
+// A mono frame has nothing to fold and is only scaled. The gain ramps
+// linearly from gain_start to gain_end over the buffer so a volume change
+// lands within one period without zipper noise.
+static void hfp_fold_apply_gain(int16_t *buffer, size_t channels, size_t frame_count,
+        int32_t gain_start, int32_t gain_end) {
+    const size_t half = channels / 2;
+    const size_t copies = half ? half : channels;
+    // gain in Q15.16 to keep the per frame step exact enough. Multiplied
+    // rather than shifted, the step is negative while ramping down.
+    int64_t gain = (int64_t)gain_start * 65536;
+    const int64_t step = frame_count ?
+            ((int64_t)(gain_end - gain_start) * 65536) / (int64_t)frame_count : 0;
+    for (size_t frame = 0; frame < frame_count; frame++) {
+        int16_t *samples = buffer + frame * channels;
+        const int32_t g = (int32_t)(gain >> 16);
+        for (size_t ch = 0; ch < copies; ch++) {
+            // g never exceeds unity, the product fits in int16_t
+            const int16_t scaled = (int16_t)((samples[half + ch] * g) >> 15);
+            samples[ch] = scaled;
+            samples[half + ch] = scaled;
+        }
+        gain += step;
+    }
+}
+
 static void *in_read_worker_bt_call(void *args) {
     struct generic_stream_in *in = (struct generic_stream_in *)args;
     struct pcm *pcm = NULL;
     bool close_pcm = false;
 
-    uint8_t *buffer = NULL;
-    uint8_t *out_buffer = NULL;
-    int buffer_frames;
+    uint8_t *buffer = in->period_buffer;
+    uint8_t *out_buffer = in->adjust_buffer;
+    const int buffer_frames = in->pcm_config.period_size;
     int buffer_size;
     int out_buffer_size;
 
     struct generic_stream_out *out_stream;
 
+    pthread_mutex_lock(&in->dev->lock);
+    int32_t gain = in->dev->hfp_call.hfp_gain;
+    pthread_mutex_unlock(&in->dev->lock);
+
     while (true) {
         int64_t ns = 0;
         pthread_mutex_lock(&in->dev->lock);
         ns = in->dev->sleep_ms;
+        const int32_t target_gain = in->dev->hfp_call.hfp_gain;
         pthread_mutex_unlock(&in->dev->lock);
 
         pthread_mutex_lock(&in->lock);
@@ -1161,12 +2136,6 @@ static void *in_read_worker_bt_call(void *args) {
                 ALOGD("%s: closing input pcm", __func__);
                 pcm_close(pcm); // Frees pcm
                 pcm = NULL;
-                free(buffer);
-                buffer = NULL;
-                if (out_buffer) {
-                    free(out_buffer);
-                    out_buffer = NULL;
-                }
             }
 
             if (in->worker_exit) {
@@ -1176,13 +2145,9 @@ static void *in_read_worker_bt_call(void *args) {
 
             close_pcm = false;
 
-            pthread_mutex_lock(&in->dev->lock);
-            if (in->device == AUDIO_DEVICE_IN_BLUETOOTH_SCO_HEADSET) {
-                in->dev->hfp_call.stream_flag |= HFP_IN_ACTIVE_FLAG;
-            } else {
-                in->dev->hfp_call.stream_flag |= MIC_IN_ACTIVE_FLAG;
-            }
-            pthread_mutex_unlock(&in->dev->lock);
+            hfp_stream_parked(in->dev,
+                    in->device == AUDIO_DEVICE_IN_BLUETOOTH_SCO_HEADSET ?
+                    HFP_IN_ACTIVE_FLAG : MIC_IN_ACTIVE_FLAG);
 
             pthread_cond_wait(&in->worker_wake, &in->lock);
         }
@@ -1192,15 +2157,24 @@ static void *in_read_worker_bt_call(void *args) {
             break;
         }
 
+        if (in->pcm_reconfigure) {
+            in->pcm_reconfigure = false;
+            if (pcm) {
+                // Reopened below with the new pcm_config
+                pcm_close(pcm);
+                pcm = NULL;
+            }
+        }
+
         if (!pcm) {
             ALOGD("%s: opening input pcm", __func__);
 
-            unsigned int card = PCM_CARD_DEFAULT;
-            unsigned int device = PCM_DEVICE_DEFAULT;
+            unsigned int card = platform.in_default.card;
+            unsigned int device = platform.in_default.device;
 
             if (in->device == AUDIO_DEVICE_IN_BLUETOOTH_SCO_HEADSET) {
-                card = PCM_CARD_HFP;
-                device = PCM_DEVICE_HFP;
+                card = platform.in_hfp.card;
+                device = platform.in_hfp.device;
             }
 
             pcm = pcm_open(card, device, PCM_IN, &in->pcm_config);
@@ -1214,14 +2188,7 @@ static void *in_read_worker_bt_call(void *args) {
                 pthread_mutex_unlock(&in->lock);
                 break;
             }
-            buffer_frames = in->pcm_config.period_size;
             buffer_size = pcm_frames_to_bytes(pcm, buffer_frames);
-            buffer = malloc(buffer_size);
-            if (!buffer) {
-                ALOGE("could not allocate worker read buffer");
-                pthread_mutex_unlock(&in->lock);
-                break;
-            }
         }
 
         int ret = pcm_read(pcm, buffer, pcm_frames_to_bytes(pcm, buffer_frames));
@@ -1237,11 +2204,9 @@ static void *in_read_worker_bt_call(void *args) {
         }
 
         if (in->device == AUDIO_DEVICE_IN_BLUETOOTH_SCO_HEADSET) {
-            size_t frame_size = buffer_size / buffer_frames;
-            for (size_t counter = 0; counter < buffer_frames; counter++) {
-                size_t offset = frame_size * counter;
-                memcpy((char*)buffer + offset, (char*)buffer + offset + frame_size / 2, frame_size / 2);
-            }
+            hfp_fold_apply_gain((int16_t *)buffer, in->pcm_config.channels, buffer_frames,
+                                gain, target_gain);
+            gain = target_gain;
         }
 
         if (in->device == AUDIO_DEVICE_IN_BLUETOOTH_SCO_HEADSET) {
@@ -1249,24 +2214,12 @@ static void *in_read_worker_bt_call(void *args) {
         } else {
             out_stream = (struct generic_stream_out *)&in->dev->hfp_call.hfp_output->stream;
         }
-        if (in->pcm_config.channels > out_stream->pcm_config.channels) {
-            out_buffer_size = buffer_frames * out_stream->pcm_config.channels *
-                    pcm_format_to_bits(out_stream->pcm_config.format) >> 3;
-            if (!out_buffer) {
-                out_buffer = malloc(out_buffer_size);
-            }
-            if (!out_buffer) {
-                ALOGE("could not allocate worker read buffer");
-                close_pcm = true;
-                pthread_mutex_unlock(&in->lock);
-                continue;
-            }
-        }
-
         //changing number of channels in buffer
         void* adjust_buffer;
         int adjust_buffer_size;
         if (in->pcm_config.channels > out_stream->pcm_config.channels) {
+            out_buffer_size = buffer_frames * out_stream->pcm_config.channels *
+                    pcm_format_to_bits(out_stream->pcm_config.format) >> 3;
             audio_buffer_adjust(out_buffer, out_stream->pcm_config.channels,
                                 buffer, in->pcm_config.channels,
                                 buffer_frames, pcm_format_to_bits(out_stream->pcm_config.format) >> 3);
@@ -1322,6 +2275,11 @@ static ssize_t in_read(struct audio_stream_in *stream, void *buffer, size_t byte
     bool mic_mute = false;
     size_t read_bytes = 0;
 
+    if (in->mmap) {
+        // The client reads the shared buffer directly
+        return -ENOSYS;
+    }
+
     adev_get_mic_mute(&adev->device, &mic_mute);
     pthread_mutex_lock(&in->lock);
 
@@ -1357,6 +2315,7 @@ static ssize_t in_read(struct audio_stream_in *stream, void *buffer, size_t byte
 
     pthread_mutex_lock(&in->lock);
 
+    const int requested_channels = audio_channel_count_from_in_mask(in->req_config.channel_mask);
     size_t read_frames = 0;
     if (in->standby) {
         ALOGW("Input put to sleep while read in progress");
@@ -1366,13 +2325,11 @@ static ssize_t in_read(struct audio_stream_in *stream, void *buffer, size_t byte
 
     memset ((uint8_t *)buffer, 0, bytes);
 
-    const int requested_channels = popcount(in->req_config.channel_mask);
-
     if (in->pcm_config.channels == requested_channels) {
         read_frames = audio_vbuffer_read(&in->buffer, buffer, frames);
     } else {
         read_frames = audio_vbuffer_read_adjust(&in->buffer, buffer,
-                                            frames, popcount(in->req_config.channel_mask));
+                                            frames, requested_channels);
     }
 
 exit:
@@ -1383,7 +2340,7 @@ exit:
          read_frames,
          frames,
          read_bytes,
-         popcount(in->req_config.channel_mask));
+         requested_channels);
 
     if (mic_mute) {
         read_bytes = 0;
@@ -1409,12 +2366,52 @@ static int in_get_capture_position(const struct audio_stream_in *stream,
     return 0;
 }
 
-static int in_add_audio_effect(const struct audio_stream *stream, effect_handle_t effect) {
-    // in_add_audio_effect is a no op
-    return 0;
-}
-
-static int in_remove_audio_effect(const struct audio_stream *stream, effect_handle_t effect) {
+static int in_start(const struct audio_stream_in *stream) {
+    struct generic_stream_in *in = (struct generic_stream_in *)stream;
+    pthread_mutex_lock(&in->lock);
+    int ret = audio_mmap_start(in->mmap);
+    if (ret == 0) {
+        in->standby = false;
+    }
+    pthread_mutex_unlock(&in->lock);
+    return ret;
+}
+
+static int in_stop(const struct audio_stream_in *stream) {
+    struct generic_stream_in *in = (struct generic_stream_in *)stream;
+    pthread_mutex_lock(&in->lock);
+    int ret = audio_mmap_stop(in->mmap);
+    pthread_mutex_unlock(&in->lock);
+    return ret;
+}
+
+static int in_create_mmap_buffer(const struct audio_stream_in *stream,
+        int32_t min_size_frames, struct audio_mmap_buffer_info *info) {
+    struct generic_stream_in *in = (struct generic_stream_in *)stream;
+    pthread_mutex_lock(&in->lock);
+    int ret = audio_mmap_create_buffer(in->mmap, min_size_frames, info);
+    pthread_mutex_unlock(&in->lock);
+    return ret;
+}
+
+static int in_get_mmap_position(const struct audio_stream_in *stream,
+        struct audio_mmap_position *position) {
+    struct generic_stream_in *in = (struct generic_stream_in *)stream;
+    if (position == NULL) {
+        return -EINVAL;
+    }
+    pthread_mutex_lock(&in->lock);
+    int ret = audio_mmap_get_position(in->mmap, position);
+    pthread_mutex_unlock(&in->lock);
+    return ret;
+}
+
+static int in_add_audio_effect(const struct audio_stream *stream, effect_handle_t effect) {
+    // in_add_audio_effect is a no op
+    return 0;
+}
+
+static int in_remove_audio_effect(const struct audio_stream *stream, effect_handle_t effect) {
     // in_add_audio_effect is a no op
     return 0;
 }
@@ -1424,12 +2421,159 @@ static int adev_get_microphones(const audio_hw_device_t *dev,
                                 struct audio_microphone_characteristic_t *mic_array,
                                 size_t *mic_count);
 
+static void describe_microphone(struct audio_microphone_characteristic_t *mic,
+                                const struct mic_array_mic *desc, unsigned int index);
+
+// The microphones the stream hears and the channels they end up in
 static int in_get_active_microphones(const struct audio_stream_in *stream,
                                      struct audio_microphone_characteristic_t *mic_array,
                                      size_t *mic_count)
 {
     struct generic_stream_in *in = (struct generic_stream_in *)stream;
-    return adev_get_microphones( &in->dev->device, mic_array, mic_count);
+    if (platform.mics.num_mics == 0) {
+        return adev_get_microphones(&in->dev->device, mic_array, mic_count);
+    }
+    if (mic_count == NULL || (*mic_count > 0 && mic_array == NULL)) {
+        return -ENOSYS;
+    }
+
+    const unsigned int channels = audio_channel_count_from_in_mask(in->req_config.channel_mask);
+    unsigned int pcm_card, pcm_device;
+    pthread_mutex_lock(&in->lock);
+    in_get_pcm_device(in, &pcm_card, &pcm_device);
+    const bool beam_steered = in_beam_steered(in, pcm_card, pcm_device);
+    pthread_mutex_unlock(&in->lock);
+    size_t count = 0;
+    for (unsigned int i = 0; i < platform.mics.num_mics; i++) {
+        const struct mic_array_mic *desc = &platform.mics.mics[i];
+        if (!beam_steered && desc->channel >= channels) {
+            continue;
+        }
+        if (count < *mic_count) {
+            struct audio_microphone_characteristic_t *mic = &mic_array[count];
+            describe_microphone(mic, desc, i);
+            for (unsigned int ch = 0; ch < channels && ch < AUDIO_CHANNEL_COUNT_MAX; ch++) {
+                if (beam_steered) {
+                    mic->channel_mapping[ch] = AUDIO_MICROPHONE_CHANNEL_MAPPING_PROCESSED;
+                } else if (ch == desc->channel) {
+                    mic->channel_mapping[ch] = AUDIO_MICROPHONE_CHANNEL_MAPPING_DIRECT;
+                }
+            }
+        }
+        count++;
+    }
+    // With *mic_count 0 the caller only asks how many there are
+    if (*mic_count == 0 || count < *mic_count) {
+        *mic_count = count;
+    }
+    return 0;
+}
+
+// MMAP streams run at the PCM configuration as is, nothing converts between
+// the client and the DMA buffer
+static int refine_mmap_output_parameters(struct audio_config *config) {
+    if (platform.out_mmap.card == UINT32_MAX || platform.out_mmap.device == UINT32_MAX) {
+        ALOGW("%s: no MMAP PCM on this platform", __func__);
+        return -ENOSYS;
+    }
+
+    bool inval = false;
+    if (config->format != AUDIO_FORMAT_PCM_16_BIT) {
+        config->format = AUDIO_FORMAT_PCM_16_BIT;
+        inval = true;
+    }
+    if (config->sample_rate != pcm_config_out_mmap.rate) {
+        config->sample_rate = pcm_config_out_mmap.rate;
+        inval = true;
+    }
+    if (popcount(config->channel_mask) != pcm_config_out_mmap.channels) {
+        config->channel_mask = audio_channel_out_mask_from_count(pcm_config_out_mmap.channels);
+        inval = true;
+    }
+    return inval ? -EINVAL : 0;
+}
+
+// Sets up an output stream whose audio never goes through the engine
+static int init_mmap_output_stream(struct generic_stream_out *out) {
+    out->mmap = (struct audio_mmap *)calloc(1, sizeof(struct audio_mmap));
+    if (!out->mmap) {
+        return -ENOMEM;
+    }
+    audio_mmap_init(out->mmap, platform.out_mmap.card, platform.out_mmap.device, PCM_OUT,
+                    &out->pcm_config, MMAP_PERIOD_COUNT_MIN, MMAP_PERIOD_COUNT_MAX);
+
+    out->stream.start = out_start;
+    out->stream.stop = out_stop;
+    out->stream.create_mmap_buffer = out_create_mmap_buffer;
+    out->stream.get_mmap_position = out_get_mmap_position;
+    return 0;
+}
+
+// Stream scratch buffers are carved out of one allocation made at stream
+// open, so the workers and the engine never touch the heap on standby and
+// resume. The arena belongs to the stream rather than to the device since
+// streams are opened and closed independently.
+#define SCRATCH_ALIGN 16
+
+struct scratch_request {
+    void **buffer;
+    size_t bytes;  // 0 leaves *buffer NULL
+};
+
+static void *scratch_alloc(const struct scratch_request *requests, size_t count) {
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++) {
+        total += (requests[i].bytes + SCRATCH_ALIGN - 1) & ~(SCRATCH_ALIGN - 1);
+    }
+
+    uint8_t *base = calloc(1, total ? total : 1);
+    if (!base) {
+        return NULL;
+    }
+
+    size_t offset = 0;
+    for (size_t i = 0; i < count; i++) {
+        *requests[i].buffer = requests[i].bytes ? base + offset : NULL;
+        offset += (requests[i].bytes + SCRATCH_ALIGN - 1) & ~(SCRATCH_ALIGN - 1);
+    }
+    return base;
+}
+
+// A bus may be served by a regular and a low-latency stream at the same time.
+// The map holds the last opened one, the others are chained through bus_next.
+static void bus_stream_attach(struct generic_audio_device *adev, struct generic_stream_out *out) {
+    pthread_mutex_lock(&adev->lock);
+    out->bus_next = hashmapGet(adev->out_bus_stream_map, (void *)out->bus_address);
+    if (out->bus_next) {
+        // Not protected by bus_next->lock, a gain update may race with it harmlessly
+        out->gain_q15 = out->bus_next->gain_q15;
+        hashmapRemove(adev->out_bus_stream_map, (void *)out->bus_next->bus_address);
+    }
+    hashmapPut(adev->out_bus_stream_map, (void *)out->bus_address, out);
+    pthread_mutex_unlock(&adev->lock);
+}
+
+static void bus_stream_detach(struct generic_audio_device *adev, struct generic_stream_out *out) {
+    pthread_mutex_lock(&adev->lock);
+    struct generic_stream_out *head = hashmapGet(adev->out_bus_stream_map,
+                                                 (void *)out->bus_address);
+    if (head == out) {
+        // The key string is owned by the stream, rekey with the next one
+        hashmapRemove(adev->out_bus_stream_map, (void *)out->bus_address);
+        if (out->bus_next) {
+            hashmapPut(adev->out_bus_stream_map, (void *)out->bus_next->bus_address,
+                       out->bus_next);
+        }
+    } else {
+        for (; head; head = head->bus_next) {
+            if (head->bus_next == out) {
+                head->bus_next = out->bus_next;
+                break;
+            }
+        }
+    }
+    out->bus_next = NULL;
+    pthread_mutex_unlock(&adev->lock);
 }
 
 static int adev_open_output_stream(struct audio_hw_device *dev,
@@ -1438,7 +2582,13 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     struct generic_audio_device *adev = (struct generic_audio_device *)dev;
     struct generic_stream_out *out;
     int ret = 0;
-    if (refine_output_parameters(&config->sample_rate, &config->format, &config->channel_mask)) {
+    if (flags & AUDIO_OUTPUT_FLAG_MMAP_NOIRQ) {
+        ret = refine_mmap_output_parameters(config);
+        if (ret != 0) {
+            return ret;
+        }
+    } else if (refine_output_parameters(&config->sample_rate, &config->format,
+                                        &config->channel_mask)) {
         ALOGE("Error opening output stream format %d, channel_mask %04x, sample_rate %u",
               config->format, config->channel_mask, config->sample_rate);
         return -EINVAL;
@@ -1469,13 +2619,27 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     out->stream.get_render_position = out_get_render_position;
     out->stream.get_presentation_position = out_get_presentation_position;
     out->stream.get_next_write_timestamp = out_get_next_write_timestamp;
+    if (!(flags & AUDIO_OUTPUT_FLAG_MMAP_NOIRQ)) {
+        out->stream.set_callback = out_set_callback;
+        out->stream.pause = out_pause;
+        out->stream.resume = out_resume;
+        out->stream.drain = out_drain;
+        out->stream.flush = out_flush;
+    }
+    // Direct PCM, nothing is decoded. MMAP streams are direct as well.
+    out->batched = (flags & AUDIO_OUTPUT_FLAG_DIRECT) &&
+            !(flags & AUDIO_OUTPUT_FLAG_MMAP_NOIRQ);
 
     pthread_mutex_init(&out->lock, (const pthread_mutexattr_t *) NULL);
     out->dev = adev;
     out->device = devices;
     memcpy(&out->req_config, config, sizeof(struct audio_config));
-    if (devices == AUDIO_DEVICE_OUT_BLUETOOTH_SCO) {
+    if (flags & AUDIO_OUTPUT_FLAG_MMAP_NOIRQ) {
+        memcpy(&out->pcm_config, &pcm_config_out_mmap, sizeof(struct pcm_config));
+    } else if (devices == AUDIO_DEVICE_OUT_BLUETOOTH_SCO) {
         memcpy(&out->pcm_config, &pcm_config_out_hfp, sizeof(struct pcm_config));
+    } else if (flags & AUDIO_OUTPUT_FLAG_FAST) {
+        memcpy(&out->pcm_config, &pcm_config_out_fast, sizeof(struct pcm_config));
     } else {
         memcpy(&out->pcm_config, &pcm_config_out_default, sizeof(struct pcm_config));
     }
@@ -1489,32 +2653,72 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     out->frames_total_buffered = 0;
     out->frames_written = 0;
     out->frames_rendered = 0;
-    if (devices == AUDIO_DEVICE_OUT_BLUETOOTH_SCO) {
-        out->amplitude_ratio = 1.0;
+    out->gain_q15 = GAIN_Q15_UNITY;
+
+    if (flags & AUDIO_OUTPUT_FLAG_MMAP_NOIRQ) {
+        ret = init_mmap_output_stream(out);
+        if (ret != 0) {
+            pthread_mutex_destroy(&out->lock);
+            free(out);
+            return ret;
+        }
+        // Bus gain is applied by the engine, keep the bus map to engine streams
+        if (address) {
+            out->bus_address = strdup(address);
+        }
+        ALOGD("%s: MMAP bus:%s", __func__, out->bus_address);
+        *stream_out = &out->stream;
+        return 0;
     }
 
     const size_t format_bytes = pcm_format_to_bits(out->pcm_config.format) >> 3;
     const size_t pcm_frame_size = out->pcm_config.channels * format_bytes;
+    // SCO may be switched to narrowband during a call, size for the lowest rate
+    const unsigned int min_pcm_rate = devices == AUDIO_DEVICE_OUT_BLUETOOTH_SCO ?
+            HFP_NB_SAMPLING_RATE : out->pcm_config.rate;
+    const bool resample = out->pcm_config.rate != out->req_config.sample_rate;
+    // Stream frames consumed by the engine per period. Batched streams are
+    // resampled by the stream worker, the engine reads them at the PCM rate.
+    const size_t period_buffer_frame_count = out->batched ? out->pcm_config.period_size :
+        (out->req_config.sample_rate * out->pcm_config.period_size) / min_pcm_rate;
+    // Batched streams hand the engine two batches, converted one at a time
+    const size_t batch_queue_frames = out->pcm_config.period_size * OUT_BATCH_PERIODS;
+    const size_t batch_queue_in_frames =
+        (batch_queue_frames * out->req_config.sample_rate) / out->pcm_config.rate;
 
     ret = audio_vbuffer_init(&out->buffer,
-            out->pcm_config.period_size * out->pcm_config.period_count,
+            out->batched ? batch_queue_frames * 2 :
+                    out->pcm_config.period_size * out->pcm_config.period_count,
             format_bytes, out->pcm_config.channels);
     if (ret != 0) {
         ALOGE("%s: audio vbuffer creation failed: %s", __func__, strerror(ret));
-        return ret;
+        goto err_buffer;
     }
-    // init resampler if necessary
-    if (out->pcm_config.rate != out->req_config.sample_rate) {
-        const size_t resampler_buffer_frame_count =
-            (out->req_config.sample_rate * out->pcm_config.period_size) / out->pcm_config.rate;
-        const size_t resampler_buffer_bytes = resampler_buffer_frame_count * pcm_frame_size;
-
-        out->resampler_buffer = malloc(resampler_buffer_bytes);
-        if (!out->resampler_buffer) {
-            ALOGE("%s: resampler_buffer creation failed", __func__);
-            return -ENOMEM;
+    if (out->batched) {
+        ret = audio_vbuffer_init(&out->batch_queue,
+                (out->req_config.sample_rate * OUT_BATCHED_BUFFER_MS) / 1000,
+                format_bytes, out->pcm_config.channels);
+        if (ret != 0) {
+            ALOGE("%s: batch vbuffer creation failed: %s", __func__, strerror(ret));
+            goto err_batch_queue;
         }
-
+    }
+    const struct scratch_request scratch[] = {
+        { &out->period_buffer, period_buffer_frame_count * pcm_frame_size },
+        { &out->resampler_buffer,
+          resample && !out->batched ? period_buffer_frame_count * pcm_frame_size : 0 },
+        { &out->batch, out->batched ? batch_queue_in_frames * pcm_frame_size : 0 },
+        { &out->batch_resampled,
+          out->batched && resample ? batch_queue_frames * pcm_frame_size : 0 },
+    };
+    out->scratch = scratch_alloc(scratch, sizeof(scratch) / sizeof(scratch[0]));
+    if (!out->scratch) {
+        ALOGE("%s: scratch buffer creation failed", __func__);
+        ret = -ENOMEM;
+        goto err_scratch;
+    }
+    // init resampler if necessary
+    if (resample) {
         ret = create_resampler(out->req_config.sample_rate,
                                out->pcm_config.rate,
                                out->pcm_config.channels,
@@ -1523,36 +2727,107 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
                                &out->resampler);
         if (ret != 0) {
             ALOGE("%s: Resampler creation failed: %s", __func__, strerror(ret));
-            return ret;
+            goto err_resampler;
         }
     } else {
         out->resampler = NULL;
-        out->resampler_buffer = NULL;
     }
 
-    // init thread
-    pthread_cond_init(&out->worker_wake, NULL);
-    out->worker_standby = true;
-    out->worker_exit = false;
-    pthread_create(&out->worker_thread, NULL, out_write_worker, out);
+    pthread_cond_init(&out->worker_wake, (const pthread_condattr_t *) NULL);
+    // Monotonic for the drain timeout
+    pthread_condattr_t drained_attr;
+    pthread_condattr_init(&drained_attr);
+    pthread_condattr_setclock(&drained_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&out->drained, &drained_attr);
+    pthread_condattr_destroy(&drained_attr);
+
+    // attach to the output engine of the target PCM
+    unsigned int quantum = 0;
+    if (devices == AUDIO_DEVICE_OUT_BLUETOOTH_SCO) {
+        out->ext_pcm = ext_pcm_open(platform.out_hfp.card, platform.out_hfp.device, PCM_OUT,
+                                    &out->pcm_config, OUT_WARM_STANDBY_MS,
+                                    &out_engine_thread_config);
+    } else if ((flags & AUDIO_OUTPUT_FLAG_FAST) &&
+               platform.out_fast.card != UINT32_MAX && platform.out_fast.device != UINT32_MAX) {
+        out->ext_pcm = ext_pcm_open(platform.out_fast.card, platform.out_fast.device,
+                                    PCM_OUT | PCM_MONOTONIC, &out->pcm_config,
+                                    OUT_WARM_STANDBY_MS, &out_engine_thread_config);
+    } else if (flags & AUDIO_OUTPUT_FLAG_FAST) {
+        // The engine may not exist yet, it must not be created with fast periods
+        out->ext_pcm = ext_pcm_open(platform.out_default.card, platform.out_default.device,
+                                    PCM_OUT | PCM_MONOTONIC, &pcm_config_out_default,
+                                    OUT_WARM_STANDBY_MS, &out_engine_thread_config);
+        quantum = out->pcm_config.period_size;
+    } else {
+        out->ext_pcm = ext_pcm_open(platform.out_default.card, platform.out_default.device,
+                                    PCM_OUT | PCM_MONOTONIC, &out->pcm_config,
+                                    OUT_WARM_STANDBY_MS, &out_engine_thread_config);
+    }
+    if (!out->ext_pcm) {
+        ALOGE("%s: output engine creation failed", __func__);
+        ret = -ENOMEM;
+        goto err_ext_pcm;
+    }
+    ret = ext_pcm_add_source(out->ext_pcm, out_engine_pull, out, quantum);
+    if (ret != 0) {
+        goto err_source;
+    }
+    if (devices == AUDIO_DEVICE_OUT_BLUETOOTH_SCO) {
+        hfp_stream_parked(adev, HFP_OUT_ACTIVE_FLAG);
+    } else {
+        pthread_mutex_lock(&adev->lock);
+        ext_pcm_set_gain(out->ext_pcm, adev->master_gain_q15);
+        pthread_mutex_unlock(&adev->lock);
+    }
 
     // set bus parameters if it is such
     if (devices != AUDIO_DEVICE_OUT_BLUETOOTH_SCO && address) {
         out->bus_address = calloc(strlen(address) + 1, sizeof(char));
         strncpy(out->bus_address, address, strlen(address));
-        hashmapPut(adev->out_bus_stream_map, (void *)out->bus_address, out);
-        /* TODO: read struct audio_gain from audio_policy_configuration */
-        out->gain_stage = (struct audio_gain) {
-            .min_value = -3200,
-            .max_value = 600,
-            .step_value = 100,
-        };
-        out->amplitude_ratio = 1.0;
-        ALOGD("%s bus:%s", __func__, out->bus_address);
+        out->gain = bus_gains_find(adev->bus_gains, address, &adev->default_bus_gain);
+        bus_stream_attach(adev, out);
+        ALOGD("%s bus:%s%s", __func__, out->bus_address,
+              (flags & AUDIO_OUTPUT_FLAG_FAST) ? " fast" :
+              out->batched ? " batched" : "");
+    }
+
+    if (out->batched) {
+        ret = out_start_worker(out);
+        if (ret != 0) {
+            goto err_worker;
+        }
     }
 
     *stream_out = &out->stream;
     return ret;
+
+err_worker:
+    if (out->bus_address) {
+        bus_stream_detach(adev, out);
+        free(out->bus_address);
+    }
+    // Must not hold out->lock, the engine takes it while pulling
+    ext_pcm_remove_source(out->ext_pcm, out);
+err_source:
+    ext_pcm_close(out->ext_pcm);
+err_ext_pcm:
+    pthread_cond_destroy(&out->worker_wake);
+    pthread_cond_destroy(&out->drained);
+    if (out->resampler) {
+        release_resampler(out->resampler);
+    }
+err_resampler:
+    free(out->scratch);
+err_scratch:
+    if (out->batched) {
+        audio_vbuffer_destroy(&out->batch_queue);
+    }
+err_batch_queue:
+    audio_vbuffer_destroy(&out->buffer);
+err_buffer:
+    pthread_mutex_destroy(&out->lock);
+    free(out);
+    return ret;
 }
 
 static void adev_close_output_stream(struct audio_hw_device *dev,
@@ -1562,23 +2837,44 @@ static void adev_close_output_stream(struct audio_hw_device *dev,
     ALOGD("%s bus:%s", __func__, out->bus_address);
     pthread_mutex_lock(&out->lock);
     do_out_standby(out);
+    pthread_mutex_unlock(&out->lock);
+
+    if (out->mmap) {
+        audio_mmap_close(out->mmap);
+        free(out->mmap);
+        free(out->bus_address);
+        pthread_mutex_destroy(&out->lock);
+        free(stream);
+        return;
+    }
 
+    pthread_mutex_lock(&out->lock);
+    const bool worker_running = out->worker_running;
     out->worker_exit = true;
     pthread_cond_signal(&out->worker_wake);
     pthread_mutex_unlock(&out->lock);
+    if (worker_running) {
+        pthread_join(out->worker_thread, NULL);
+    }
+    pthread_cond_destroy(&out->worker_wake);
+    pthread_cond_destroy(&out->drained);
+    if (out->batched) {
+        audio_vbuffer_destroy(&out->batch_queue);
+    }
 
-    pthread_join(out->worker_thread, NULL);
+    // Must not hold out->lock, the engine takes it while pulling. Frames
+    // still draining are dropped with the stream.
+    ext_pcm_remove_source(out->ext_pcm, out);
+    ext_pcm_close(out->ext_pcm);
     pthread_mutex_destroy(&out->lock);
     audio_vbuffer_destroy(&out->buffer);
 
     if (out->bus_address) {
-        hashmapRemove(adev->out_bus_stream_map, (void *)out->bus_address);
+        bus_stream_detach(adev, out);
         free((void *)out->bus_address);
     }
 
-    if (out->resampler_buffer) {
-        free(out->resampler_buffer);
-    }
+    free(out->scratch);
 
     if (out->resampler) {
         release_resampler(out->resampler);
@@ -1587,14 +2883,15 @@ static void adev_close_output_stream(struct audio_hw_device *dev,
     free(stream);
 }
 
+// Creates the HFP bridge streams. They are opened once at device open and
+// stay parked in standby between calls, see start_hfp_call()
 static void open_hfp_handles(struct generic_audio_device *adev)
 {
-    adev->hfp_call.stream_flag = 0;
-
     if (adev->hfp_call.hfp_input == NULL) {
         struct audio_stream_in *stream_in;
         struct audio_config config = {
-                DEFAULT_IN_SAMPLING_RATE, AUDIO_CHANNEL_IN_STEREO, AUDIO_FORMAT_PCM_16_BIT, {}, IN_PERIOD_SIZE};
+                pcm_config_in_default.rate, AUDIO_CHANNEL_IN_STEREO, AUDIO_FORMAT_PCM_16_BIT, {},
+                IN_PERIOD_SIZE};
         int res = adev->device.open_input_stream(&adev->device, 0,
                 AUDIO_DEVICE_IN_BLUETOOTH_SCO_HEADSET, &config, &stream_in, AUDIO_INPUT_FLAG_NONE, "",
                 AUDIO_SOURCE_VOICE_CALL);
@@ -1609,7 +2906,8 @@ static void open_hfp_handles(struct generic_audio_device *adev)
     if (adev->hfp_call.mic_input == NULL) {
         struct audio_stream_in *stream_in;
         struct audio_config config = {
-                DEFAULT_IN_SAMPLING_RATE, AUDIO_CHANNEL_IN_STEREO, AUDIO_FORMAT_PCM_16_BIT, {}, IN_PERIOD_SIZE};
+                pcm_config_in_default.rate, AUDIO_CHANNEL_IN_STEREO, AUDIO_FORMAT_PCM_16_BIT, {},
+                IN_PERIOD_SIZE};
         int res = adev->device.open_input_stream(&adev->device, 0,
                 AUDIO_DEVICE_IN_BUILTIN_MIC, &config, &stream_in, AUDIO_INPUT_FLAG_NONE, "",
                 AUDIO_SOURCE_VOICE_CALL);
@@ -1624,7 +2922,8 @@ static void open_hfp_handles(struct generic_audio_device *adev)
     if (adev->hfp_call.hfp_output == NULL) {
         struct audio_stream_out *stream_out;
         struct audio_config config = {
-                DEFAULT_OUT_SAMPLING_RATE, AUDIO_CHANNEL_OUT_STEREO, AUDIO_FORMAT_PCM_16_BIT, {}, OUT_PERIOD_SIZE};
+                pcm_config_out_default.rate, AUDIO_CHANNEL_OUT_STEREO, AUDIO_FORMAT_PCM_16_BIT, {},
+                OUT_PERIOD_SIZE};
         int res = adev->device.open_output_stream(&adev->device, 0,
                 AUDIO_DEVICE_OUT_BLUETOOTH_SCO, AUDIO_OUTPUT_FLAG_NONE, &config, &stream_out, "");
         if (res == 0) {
@@ -1638,9 +2937,14 @@ static void open_hfp_handles(struct generic_audio_device *adev)
     if (adev->hfp_call.headset_output == NULL) {
         struct audio_stream_out *stream_out;
         struct audio_config config = {
-                DEFAULT_OUT_SAMPLING_RATE, AUDIO_CHANNEL_OUT_STEREO, AUDIO_FORMAT_PCM_16_BIT, {}, OUT_PERIOD_SIZE};
+                pcm_config_out_default.rate, AUDIO_CHANNEL_OUT_STEREO, AUDIO_FORMAT_PCM_16_BIT, {},
+                OUT_PERIOD_SIZE};
+        // No address, so the sink stays a private source of the default
+        // engine. It lives as long as the device and must not take a bus
+        // from streams the framework opens. The call volume is applied by
+        // the SCO capture worker.
         int res = adev->device.open_output_stream(&adev->device, 0,
-                AUDIO_DEVICE_OUT_BUS, AUDIO_OUTPUT_FLAG_NONE, &config, &stream_out, HFP_STREAM_BT_OUT_ADDRESS);
+                AUDIO_DEVICE_OUT_BUS, AUDIO_OUTPUT_FLAG_NONE, &config, &stream_out, NULL);
         if (res == 0) {
             pthread_mutex_lock(&adev->lock);
             adev->hfp_call.headset_output = (struct generic_stream_out*)stream_out;
@@ -1658,8 +2962,9 @@ static void close_hfp_handles(struct generic_audio_device *adev)
     struct generic_stream_in *mic = adev->hfp_call.mic_input;
     struct generic_stream_out *hfp_out = adev->hfp_call.hfp_output;
     struct generic_stream_out *stereo_out = adev->hfp_call.headset_output;
-    adev->hfp_call.stream_flag = 0;
+    adev->hfp_call.active = false;
     pthread_mutex_unlock(&adev->lock);
+    hfp_streams_unparked(adev);
 
     if (hfp_in) {
         pthread_mutex_lock(&hfp_in->lock);
@@ -1682,9 +2987,6 @@ static void close_hfp_handles(struct generic_audio_device *adev)
     }
 
     if (hfp_out) {
-        pthread_mutex_lock(&hfp_out->lock);
-        hfp_out->worker_standby = true;
-        pthread_mutex_unlock(&hfp_out->lock);
         adev->device.close_output_stream(&adev->device, &hfp_out->stream);
         pthread_mutex_lock(&adev->lock);
         adev->hfp_call.hfp_output = NULL;
@@ -1692,31 +2994,178 @@ static void close_hfp_handles(struct generic_audio_device *adev)
     }
 
     if (stereo_out) {
-        stereo_out->stream.common.standby(&stereo_out->stream.common);
+        adev->device.close_output_stream(&adev->device, &stereo_out->stream);
+        pthread_mutex_lock(&adev->lock);
+        adev->hfp_call.headset_output = NULL;
+        pthread_mutex_unlock(&adev->lock);
     }
 }
 
+static bool hfp_handles_opened(struct generic_audio_device *adev) {
+    pthread_mutex_lock(&adev->lock);
+    bool opened = adev->hfp_call.hfp_input && adev->hfp_call.mic_input &&
+            adev->hfp_call.hfp_output && adev->hfp_call.headset_output;
+    pthread_mutex_unlock(&adev->lock);
+    return opened;
+}
+
+// Waits until every worker in mask has parked in standby.
+// Returns false if HFP_READY_TIMEOUT_MS elapsed first.
+static bool wait_hfp_streams_parked(struct generic_audio_device *adev, uint8_t mask) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_nsec += HFP_READY_TIMEOUT_MS * 1000000LL;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000LL;
+    deadline.tv_nsec %= 1000000000LL;
+
+    pthread_mutex_lock(&adev->hfp_call.ready_lock);
+    while ((adev->hfp_call.stream_flag & mask) != mask) {
+        if (pthread_cond_timedwait(&adev->hfp_call.ready, &adev->hfp_call.ready_lock,
+                                   &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    bool parked = (adev->hfp_call.stream_flag & mask) == mask;
+    pthread_mutex_unlock(&adev->hfp_call.ready_lock);
+    return parked;
+}
+
 static void start_hfp_call(struct generic_audio_device *adev) {
+    hfp_streams_unparked(adev);
+    pthread_mutex_lock(&adev->lock);
+    adev->hfp_call.active = true;
+    adev->sleep_ms = 1000;
+    pthread_mutex_unlock(&adev->lock);
 
+    // Both capture workers open their PCMs concurrently, the output
+    // engines follow as soon as the first bridged period reaches them.
     pthread_mutex_lock(&adev->hfp_call.hfp_input->lock);
     adev->hfp_call.hfp_input->worker_standby = false;
+    pthread_cond_signal(&adev->hfp_call.hfp_input->worker_wake);
     pthread_mutex_unlock(&adev->hfp_call.hfp_input->lock);
 
     pthread_mutex_lock(&adev->hfp_call.mic_input->lock);
     adev->hfp_call.mic_input->worker_standby = false;
+    pthread_cond_signal(&adev->hfp_call.mic_input->worker_wake);
     pthread_mutex_unlock(&adev->hfp_call.mic_input->lock);
+}
 
+static void stop_hfp_call(struct generic_audio_device *adev) {
     pthread_mutex_lock(&adev->lock);
-    adev->sleep_ms = 1000;
+    adev->sleep_ms = 0;
+    adev->hfp_call.active = false;
     pthread_mutex_unlock(&adev->lock);
 
-    pthread_cond_signal(&adev->hfp_call.hfp_input->worker_wake);
-    pthread_cond_signal(&adev->hfp_call.mic_input->worker_wake);
+    struct generic_stream_in *inputs[] = {
+        adev->hfp_call.hfp_input,
+        adev->hfp_call.mic_input,
+    };
+    for (size_t i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i++) {
+        pthread_mutex_lock(&inputs[i]->lock);
+        inputs[i]->worker_standby = true;
+        pthread_cond_signal(&inputs[i]->worker_wake);
+        pthread_mutex_unlock(&inputs[i]->lock);
+    }
+
+    // The capture workers feed the outputs, so let them park first
+    if (!wait_hfp_streams_parked(adev, ALL_IN_ACTIVE_FLAG)) {
+        ALOGW("%s: HFP capture workers did not park in time", __func__);
+    }
+
+    adev->hfp_call.hfp_output->stream.common.standby(
+            &adev->hfp_call.hfp_output->stream.common);
+    adev->hfp_call.headset_output->stream.common.standby(
+            &adev->hfp_call.headset_output->stream.common);
 }
 
-static void stop_hfp_call(struct generic_audio_device *adev) {
+// Swaps the resampler of a stream whose PCM rate changed. The buffers were
+// sized for HFP_NB_SAMPLING_RATE at open and are reused as is.
+static int replace_resampler(struct resampler_itfe **resampler, uint32_t in_rate,
+        uint32_t out_rate, uint32_t channels) {
+    if (*resampler) {
+        release_resampler(*resampler);
+        *resampler = NULL;
+    }
+    if (in_rate == out_rate) {
+        return 0;
+    }
+    return create_resampler(in_rate, out_rate, channels, RESAMPLER_QUALITY_DEFAULT,
+                            NULL, resampler);
+}
+
+// Switches the SCO link between wideband and narrowband. The bridge streams
+// stay open; only the SCO PCMs are reopened at the next period.
+static int hfp_set_sample_rate(struct generic_audio_device *adev, unsigned int rate) {
+    if (rate != HFP_WB_SAMPLING_RATE && rate != HFP_NB_SAMPLING_RATE) {
+        ALOGW("%s: unsupported HFP rate %u", __func__, rate);
+        return -EINVAL;
+    }
+
     pthread_mutex_lock(&adev->lock);
-    adev->sleep_ms = 0;
+    if (adev->hfp_call.sample_rate == rate) {
+        pthread_mutex_unlock(&adev->lock);
+        return 0;
+    }
+    adev->hfp_call.sample_rate = rate;
+    pcm_config_in_hfp.rate = rate;
+    pcm_config_out_hfp.rate = rate;
+    struct generic_stream_in *hfp_in = adev->hfp_call.hfp_input;
+    struct generic_stream_out *hfp_out = adev->hfp_call.hfp_output;
+    pthread_mutex_unlock(&adev->lock);
+
+    int ret = 0;
+    if (hfp_in) {
+        pthread_mutex_lock(&hfp_in->lock);
+        hfp_in->pcm_config.rate = rate;
+        ret = replace_resampler(&hfp_in->resampler, rate, hfp_in->req_config.sample_rate,
+                                hfp_in->pcm_config.channels);
+        hfp_in->pcm_reconfigure = true;
+        pthread_cond_signal(&hfp_in->worker_wake);
+        pthread_mutex_unlock(&hfp_in->lock);
+    }
+    if (hfp_out && ret == 0) {
+        pthread_mutex_lock(&hfp_out->lock);
+        hfp_out->pcm_config.rate = rate;
+        ret = replace_resampler(&hfp_out->resampler, hfp_out->req_config.sample_rate, rate,
+                                hfp_out->pcm_config.channels);
+        ext_pcm_reconfigure(hfp_out->ext_pcm, &hfp_out->pcm_config);
+        pthread_mutex_unlock(&hfp_out->lock);
+    }
+    if (ret != 0) {
+        ALOGE("%s: Resampler creation failed: %s", __func__, strerror(-ret));
+        return ret;
+    }
+
+    ALOGD("%s: HFP rate %u", __func__, rate);
+    return 0;
+}
+
+// Parses a comma separated millibel value per channel, see
+// AUDIO_PARAMETER_KEY_MIC_TRIM. A malformed list leaves the trim as it is.
+static void set_mic_trim(struct generic_audio_device *adev, char *values) {
+    int32_t trim_q15[MIC_TRIM_MAX_CHANNELS];
+    unsigned int channels = 0;
+    char *saveptr = NULL;
+    for (char *value = strtok_r(values, ",", &saveptr); value;
+         value = strtok_r(NULL, ",", &saveptr)) {
+        char *end;
+        const long mb = strtol(value, &end, 10);
+        if (end == value || *end != '\0' || channels == MIC_TRIM_MAX_CHANNELS) {
+            ALOGW("%s: ignoring malformed trim", __func__);
+            return;
+        }
+        trim_q15[channels++] = amplitude_to_q15(powf(10, mb / 2000.0f));
+    }
+    for (; channels < MIC_TRIM_MAX_CHANNELS; channels++) {
+        trim_q15[channels] = GAIN_Q15_UNITY;
+    }
+
+    pthread_mutex_lock(&adev->lock);
+    audio_seqlock_write_begin(&adev->mic_trim_lock);
+    for (unsigned int ch = 0; ch < MIC_TRIM_MAX_CHANNELS; ch++) {
+        atomic_store_explicit(&adev->mic_trim_q15[ch], trim_q15[ch], memory_order_relaxed);
+    }
+    audio_seqlock_write_end(&adev->mic_trim_lock);
     pthread_mutex_unlock(&adev->lock);
 }
 
@@ -1728,45 +3177,52 @@ static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
 
     parms = str_parms_create_str(kvpairs);
     if (str_parms_get_str(parms, AUDIO_PARAMETER_KEY_HFP_ENABLE, value, sizeof(value)) >= 0) {
-        if (strcmp(value, "true") == 0) {
-            open_hfp_handles(adev);
-            int sleep_time = 0;
-            int stream_flag = 0;
-            while (sleep_time < SLEEP_MAX) {
-                pthread_mutex_lock(&adev->lock);
-                stream_flag = adev->hfp_call.stream_flag;
-                pthread_mutex_unlock(&adev->lock);
-                if (stream_flag == ALL_ACTIVE_FLAG) {
-                    break;
-                }
-                usleep(SLEEP_MS);
-                sleep_time += SLEEP_MS;
+        pthread_mutex_lock(&adev->lock);
+        bool active = adev->hfp_call.active;
+        pthread_mutex_unlock(&adev->lock);
+        if (platform.out_hfp.card == UINT32_MAX) {
+            ALOGW("%s: HFP is not supported on this platform", __func__);
+        } else if (strcmp(value, "true") == 0 && !active) {
+            if (!hfp_handles_opened(adev)) {
+                // Streams normally exist since adev_open, retry a failed creation
+                open_hfp_handles(adev);
             }
-            if (stream_flag == ALL_ACTIVE_FLAG) {
+            if (hfp_handles_opened(adev) &&
+                    wait_hfp_streams_parked(adev, ALL_ACTIVE_FLAG)) {
                 start_hfp_call(adev);
             } else {
-                close_hfp_handles(adev);
+                ALOGE("%s: HFP streams are not ready, call is not started", __func__);
             }
-        } else if (strcmp(value, "false") == 0) {
+        } else if (strcmp(value, "false") == 0 && active) {
             stop_hfp_call(adev);
-            close_hfp_handles(adev);
         }
     } else if (str_parms_get_str(parms, AUDIO_PARAMETER_KEY_HFP_SET_SAMPLING_RATE,
             value, sizeof(value)) >= 0) {
         val = atoi(value);
         if (val > 0) {
-            // todo: hack to enable 8kHz connect (actually fake on 16 kHz)
-            //pcm_config_in_hfp.rate = val;
-            //pcm_config_out_hfp.rate = val;
+            hfp_set_sample_rate(adev, val);
+        }
+    } else if (str_parms_get_str(parms, AUDIO_PARAMETER_KEY_BT_SCO_WB,
+            value, sizeof(value)) >= 0) {
+        if (strcmp(value, AUDIO_PARAMETER_VALUE_ON) == 0) {
+            hfp_set_sample_rate(adev, HFP_WB_SAMPLING_RATE);
+        } else if (strcmp(value, AUDIO_PARAMETER_VALUE_OFF) == 0) {
+            hfp_set_sample_rate(adev, HFP_NB_SAMPLING_RATE);
         }
     } else if (str_parms_get_str(parms, AUDIO_PARAMETER_KEY_HFP_VOLUME,
             value, sizeof(value)) >= 0) {
         val = atoi(value);
-        if (val > 0) {
+        if (val <= HFP_VOLUME_MAX) {
             pthread_mutex_lock(&adev->lock);
             adev->hfp_call.hfp_volume = val;
+            adev->hfp_call.hfp_gain = hfp_volume_to_gain(val);
             pthread_mutex_unlock(&adev->lock);
         }
+    } else {
+        char trim[MIC_TRIM_MAX_CHANNELS * 8];
+        if (str_parms_get_str(parms, AUDIO_PARAMETER_KEY_MIC_TRIM, trim, sizeof(trim)) >= 0) {
+            set_mic_trim(adev, trim);
+        }
     }
     str_parms_destroy(parms);
 
@@ -1774,7 +3230,28 @@ static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
 }
 
 static char *adev_get_parameters(const struct audio_hw_device *dev, const char *keys) {
-    return NULL;
+    struct generic_audio_device *adev = (struct generic_audio_device *)dev;
+    struct str_parms *query = str_parms_create_str(keys);
+    struct str_parms *reply = str_parms_create();
+    char *str;
+
+    pthread_mutex_lock(&adev->lock);
+    unsigned int rate = adev->hfp_call.sample_rate;
+    pthread_mutex_unlock(&adev->lock);
+
+    if (str_parms_has_key(query, AUDIO_PARAMETER_KEY_BT_SCO_WB)) {
+        str_parms_add_str(reply, AUDIO_PARAMETER_KEY_BT_SCO_WB,
+                rate == HFP_WB_SAMPLING_RATE ?
+                AUDIO_PARAMETER_VALUE_ON : AUDIO_PARAMETER_VALUE_OFF);
+    }
+    if (str_parms_has_key(query, AUDIO_PARAMETER_KEY_HFP_SET_SAMPLING_RATE)) {
+        str_parms_add_int(reply, AUDIO_PARAMETER_KEY_HFP_SET_SAMPLING_RATE, rate);
+    }
+    str = strdup(str_parms_to_str(reply));
+
+    str_parms_destroy(query);
+    str_parms_destroy(reply);
+    return str;
 }
 
 static int adev_init_check(const struct audio_hw_device *dev) {
@@ -1786,12 +3263,38 @@ static int adev_set_voice_volume(struct audio_hw_device *dev, float volume) {
     return 0;
 }
 
+// Master volume is applied by the engines of the media PCMs on their final
+// mix, the call uplink to SCO is left alone
+static bool master_gain_applies(unsigned int card, unsigned int device) {
+    return card != UINT32_MAX && device != UINT32_MAX &&
+           (card != platform.out_hfp.card || device != platform.out_hfp.device);
+}
+
 static int adev_set_master_volume(struct audio_hw_device *dev, float volume) {
-    return -ENOSYS;
+    ALOGD("%s: %f", __func__, volume);
+    struct generic_audio_device *adev = (struct generic_audio_device *)dev;
+    if (!(volume >= 0.0f && volume <= 1.0f)) {
+        return -EINVAL;
+    }
+    pthread_mutex_lock(&adev->lock);
+    adev->master_volume = volume;
+    adev->master_gain_q15 = lrintf(volume * EXT_PCM_GAIN_UNITY);
+    const struct audio_platform_pcm *pcms[] = { &platform.out_default, &platform.out_fast };
+    for (unsigned int i = 0; i < sizeof(pcms) / sizeof(pcms[0]); i++) {
+        if (master_gain_applies(pcms[i]->card, pcms[i]->device)) {
+            ext_pcm_set_device_gain(pcms[i]->card, pcms[i]->device, adev->master_gain_q15);
+        }
+    }
+    pthread_mutex_unlock(&adev->lock);
+    return 0;
 }
 
 static int adev_get_master_volume(struct audio_hw_device *dev, float *volume) {
-    return -ENOSYS;
+    struct generic_audio_device *adev = (struct generic_audio_device *)dev;
+    pthread_mutex_lock(&adev->lock);
+    *volume = adev->master_volume;
+    pthread_mutex_unlock(&adev->lock);
+    return 0;
 }
 
 static int adev_set_master_mute(struct audio_hw_device *dev, bool muted) {
@@ -1838,12 +3341,66 @@ static size_t adev_get_input_buffer_size(const struct audio_hw_device *dev,
     return get_input_buffer_size(config->sample_rate, config->format, config->channel_mask);
 }
 
+// MMAP capture runs at the PCM configuration as is, like MMAP output
+static int refine_mmap_input_parameters(audio_devices_t devices, struct audio_config *config) {
+    if (devices != AUDIO_DEVICE_IN_BUILTIN_MIC) {
+        ALOGW("%s: MMAP capture is only available from the built-in mic", __func__);
+        return -ENOSYS;
+    }
+    if (platform.in_mmap.card == UINT32_MAX || platform.in_mmap.device == UINT32_MAX) {
+        ALOGW("%s: no MMAP capture PCM on this platform", __func__);
+        return -ENOSYS;
+    }
+
+    bool inval = false;
+    if (config->format != AUDIO_FORMAT_PCM_16_BIT) {
+        config->format = AUDIO_FORMAT_PCM_16_BIT;
+        inval = true;
+    }
+    if (config->sample_rate != pcm_config_in_mmap.rate) {
+        config->sample_rate = pcm_config_in_mmap.rate;
+        inval = true;
+    }
+    if (audio_channel_count_from_in_mask(config->channel_mask) != pcm_config_in_mmap.channels) {
+        // Positional masks stop at stereo, the mic array is index assigned
+        config->channel_mask = pcm_config_in_mmap.channels <= 2 ?
+                audio_channel_in_mask_from_count(pcm_config_in_mmap.channels) :
+                audio_channel_mask_for_index_assignment_from_count(pcm_config_in_mmap.channels);
+        inval = true;
+    }
+    return inval ? -EINVAL : 0;
+}
+
+static int init_mmap_input_stream(struct generic_stream_in *in) {
+    in->mmap = (struct audio_mmap *)calloc(1, sizeof(struct audio_mmap));
+    if (!in->mmap) {
+        return -ENOMEM;
+    }
+    audio_mmap_init(in->mmap, platform.in_mmap.card, platform.in_mmap.device, PCM_IN,
+                    &in->pcm_config, MMAP_PERIOD_COUNT_MIN, MMAP_PERIOD_COUNT_MAX);
+
+    in->stream.start = in_start;
+    in->stream.stop = in_stop;
+    in->stream.create_mmap_buffer = in_create_mmap_buffer;
+    in->stream.get_mmap_position = in_get_mmap_position;
+    return 0;
+}
+
 static void adev_close_input_stream(struct audio_hw_device *dev,
         struct audio_stream_in *stream) {
     struct generic_stream_in *in = (struct generic_stream_in *)stream;
     pthread_mutex_lock(&in->lock);
     do_in_standby(in);
 
+    if (in->mmap) {
+        pthread_mutex_unlock(&in->lock);
+        audio_mmap_close(in->mmap);
+        free(in->mmap);
+        pthread_mutex_destroy(&in->lock);
+        free(stream);
+        return;
+    }
+
     in->worker_exit = true;
     pthread_cond_signal(&in->worker_wake);
     pthread_mutex_unlock(&in->lock);
@@ -1853,12 +3410,11 @@ static void adev_close_input_stream(struct audio_hw_device *dev,
         free((void *)in->bus_address);
     }
 
+    pthread_cond_destroy(&in->worker_wake);
     pthread_mutex_destroy(&in->lock);
     audio_vbuffer_destroy(&in->buffer);
 
-    if (in->resampler_buffer) {
-        free(in->resampler_buffer);
-    }
+    free(in->scratch);
 
     if (in->resampler) {
         release_resampler(in->resampler);
@@ -1874,8 +3430,15 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
     struct generic_audio_device *adev = (struct generic_audio_device *)dev;
     struct generic_stream_in *in;
     int ret = 0;
+    const bool mmap = (flags & AUDIO_INPUT_FLAG_MMAP_NOIRQ) != 0;
 
-    if (refine_input_parameters(&config->sample_rate, &config->format, &config->channel_mask)) {
+    if (mmap) {
+        ret = refine_mmap_input_parameters(devices, config);
+        if (ret != 0) {
+            return ret;
+        }
+    } else if (refine_input_parameters(&config->sample_rate, &config->format,
+                                       &config->channel_mask)) {
         ALOGE("Error opening input stream format %d, channel_mask %04x, sample_rate %u",
               config->format, config->channel_mask, config->sample_rate);
         return -EINVAL;
@@ -1898,7 +3461,7 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
     in->stream.common.get_parameters = in_get_parameters;
     in->stream.common.add_audio_effect = in_add_audio_effect;       // no op
     in->stream.common.remove_audio_effect = in_remove_audio_effect; // no op
-    in->stream.set_gain = in_set_gain;                              // no op
+    in->stream.set_gain = in_set_gain;
     in->stream.read = in_read;
     in->stream.get_input_frames_lost = in_get_input_frames_lost;    // no op
     in->stream.get_capture_position = in_get_capture_position;
@@ -1906,8 +3469,28 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
     pthread_mutex_init(&in->lock, (const pthread_mutexattr_t *) NULL);
     in->dev = adev;
     in->device = devices;
+    in->gain = 1.0f;
+    in->gain_q15 = GAIN_Q15_UNITY;
     memcpy(&in->req_config, config, sizeof(struct audio_config));
-    if (in->device == AUDIO_DEVICE_IN_FM_TUNER) {
+
+    unsigned int pcm_card, pcm_device;
+    in_get_pcm_device(in, &pcm_card, &pcm_device);
+    const bool mic_pcm = !mmap && source != AUDIO_SOURCE_VOICE_CALL &&
+            pcm_card == platform.in_default.card && pcm_device == platform.in_default.device;
+    const bool index_mask = audio_channel_mask_get_representation(config->channel_mask) ==
+            AUDIO_CHANNEL_REPRESENTATION_INDEX;
+    if (index_mask && !mmap && !mic_pcm) {
+        // Only the microphone PCM is exposed channel by channel
+        ALOGE("%s: channel index masks are only supported on the microphones", __func__);
+        config->channel_mask = AUDIO_CHANNEL_IN_STEREO;
+        pthread_mutex_destroy(&in->lock);
+        free(in);
+        return -EINVAL;
+    }
+    if (mmap) {
+        memcpy(&in->pcm_config, &pcm_config_in_mmap, sizeof(struct pcm_config));
+        in->stream.get_active_microphones = in_get_active_microphones;
+    } else if (in->device == AUDIO_DEVICE_IN_FM_TUNER) {
         memcpy(&in->pcm_config, &pcm_config_in_fm, sizeof(struct pcm_config));
     } else if (in->device == AUDIO_DEVICE_IN_BLUETOOTH_SCO_HEADSET) {
         memcpy(&in->pcm_config, &pcm_config_in_hfp, sizeof(struct pcm_config));
@@ -1924,23 +3507,54 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
     in->standby_exit_time.tv_nsec = 0;
     in->standby_frames_read = 0;
 
+    if (mmap) {
+        ret = init_mmap_input_stream(in);
+        if (ret != 0) {
+            pthread_mutex_destroy(&in->lock);
+            free(in);
+            return ret;
+        }
+        *stream_in = &in->stream;
+        return 0;
+    }
+
     size_t format_bytes = pcm_format_to_bits(in->pcm_config.format) >> 3;
     const size_t pcm_frame_size = in->pcm_config.channels * format_bytes;
-    size_t buffer_frame_count = 0;
-
-    // init resampler
-    if (in->pcm_config.rate != in->req_config.sample_rate) {
+    const size_t period_bytes = in->pcm_config.period_size * pcm_frame_size;
+    const bool resample = in->pcm_config.rate != in->req_config.sample_rate;
+    size_t buffer_frame_count = in->pcm_config.period_size;
+
+    if (resample) {
+        // SCO may be switched to narrowband during a call, size for the lowest rate
+        const unsigned int min_pcm_rate = devices == AUDIO_DEVICE_IN_BLUETOOTH_SCO_HEADSET ?
+                HFP_NB_SAMPLING_RATE : in->pcm_config.rate;
         buffer_frame_count = (in->pcm_config.period_size * in->req_config.sample_rate)
-                                    / in->pcm_config.rate;
-
-        size_t buffer_bytes = buffer_frame_count * pcm_frame_size;
+                                    / min_pcm_rate;
+    }
 
-        in->resampler_buffer = malloc(buffer_bytes);
-        if (!in->resampler_buffer) {
-            ALOGE("%s: resampler_buffer creation failed", __func__);
-            return -ENOMEM;
-        }
+    // The bridge worker folds channels before forwarding to an output with fewer
+    // Mono or stereo from an array is steered rather than cut down to the
+    // first microphones
+    const bool beam = mic_pcm && !index_mask && platform.mics.has_beam &&
+            audio_channel_count_from_in_mask(config->channel_mask) < in->pcm_config.channels;
+    const struct scratch_request scratch[] = {
+        { &in->period_buffer, period_bytes },
+        { &in->adjust_buffer, source == AUDIO_SOURCE_VOICE_CALL ? period_bytes : 0 },
+        { &in->resampler_buffer, resample ? buffer_frame_count * pcm_frame_size : 0 },
+        { &in->beam_history, beam ? beamformer_history_bytes(&platform.mics) : 0 },
+    };
+    in->scratch = scratch_alloc(scratch, sizeof(scratch) / sizeof(scratch[0]));
+    if (!in->scratch) {
+        ALOGE("%s: scratch buffer creation failed", __func__);
+        pthread_mutex_destroy(&in->lock);
+        free(in);
+        return -ENOMEM;
+    }
+    in->beamforming = beam && beamformer_init(&in->beamformer, &platform.mics,
+            in->pcm_config.channels, in->pcm_config.rate, in->beam_history) == 0;
 
+    // init resampler
+    if (resample) {
         ret = create_resampler(in->pcm_config.rate,
                                in->req_config.sample_rate,
                                in->pcm_config.channels,
@@ -1949,12 +3563,10 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
                                &in->resampler);
         if (ret != 0) {
             ALOGE("%s: Resampler creation failed", __func__);
-            return ret;
+            goto err_resampler;
         }
     } else {
         in->resampler = NULL;
-        in->resampler_buffer = NULL;
-        buffer_frame_count = in->pcm_config.period_size;
     }
 
     ret = audio_vbuffer_init(&in->buffer,
@@ -1962,72 +3574,340 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
             format_bytes, in->pcm_config.channels);
     if (ret != 0) {
         ALOGE("%s: audio_vbuffer creation failed: %s", __func__, strerror(ret));
-        return ret;
+        goto err_buffer;
     }
 
-    pthread_cond_init(&in->worker_wake, NULL);
+    // Monotonic for the warm standby timeout
+    pthread_condattr_t wake_attr;
+    pthread_condattr_init(&wake_attr);
+    pthread_condattr_setclock(&wake_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&in->worker_wake, &wake_attr);
+    pthread_condattr_destroy(&wake_attr);
     in->worker_standby = true;
     in->worker_exit = false;
-    if (source == AUDIO_SOURCE_VOICE_CALL) {
-        pthread_create(&in->worker_thread, NULL, in_read_worker_bt_call, in);
-    } else {
-        pthread_create(&in->worker_thread, NULL, in_read_worker, in);
-    }
-
     if (address) {
         in->bus_address = calloc(strlen(address) + 1, sizeof(char));
         strncpy(in->bus_address, address, strlen(address));
     }
 
+    const char *thread_suffix = in->device == AUDIO_DEVICE_IN_BLUETOOTH_SCO_HEADSET ? "sco" :
+            in->device == AUDIO_DEVICE_IN_FM_TUNER ? "fm" :
+            in->device == AUDIO_DEVICE_IN_BUILTIN_MIC ? "mic" : in->bus_address;
+    if (source == AUDIO_SOURCE_VOICE_CALL) {
+        ret = audio_thread_create(&in->worker_thread, &hfp_worker_thread_config,
+                                  thread_suffix, in_read_worker_bt_call, in);
+    } else {
+        ret = audio_thread_create(&in->worker_thread, &in_worker_thread_config,
+                                  thread_suffix, in_read_worker, in);
+    }
+    if (ret != 0) {
+        goto err_thread;
+    }
+
     *stream_in = &in->stream;
 
     return ret;
+
+err_thread:
+    free(in->bus_address);
+    pthread_cond_destroy(&in->worker_wake);
+    audio_vbuffer_destroy(&in->buffer);
+err_buffer:
+    if (in->resampler) {
+        release_resampler(in->resampler);
+    }
+err_resampler:
+    free(in->scratch);
+    pthread_mutex_destroy(&in->lock);
+    free(in);
+    return ret;
 }
 
 static int adev_dump(const audio_hw_device_t *dev, int fd) {
     return 0;
 }
 
+// Codec volume of a bus, NULL if the bus gain is applied in software
+static const struct bus_volume *find_bus_volume(const struct generic_audio_device *adev,
+        const char *bus_address) {
+    for (const struct device_card *card = adev->device_cards;
+         card && card->card != UINT32_MAX; card++) {
+        for (const struct bus_volume *volume = card->volumes;
+             volume && volume->bus_address; volume++) {
+            if (strcmp(volume->bus_address, bus_address) == 0) {
+                return volume->ctl ? volume : NULL;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Sets the control to the amplitude the software gain would apply at the
+// step, in millibels. It never goes above 0 dB, the codec only attenuates.
+// The lowest step is silent in software, it takes the lowest control value,
+// which mutes, as does anything at or below db_min.
+static void bus_set_hw_volume(const struct bus_volume *volume, const struct bus_gain *gain,
+        int value) {
+    const int min = mixer_ctl_get_range_min(volume->ctl);
+    const int max = mixer_ctl_get_range_max(volume->ctl);
+    const float amplitude = gain->amplitude[bus_gain_step(gain, value)];
+    int target = INT_MIN;
+    int raw = min;
+    if (amplitude > 0) {
+        const long millibels = lrintf(2000 * log10f(amplitude));
+        target = millibels > 0 ? 0 : (int)millibels;
+    }
+    if (target > volume->db_min) {
+        // Nearest control value
+        raw = min + (target - volume->db_min + volume->db_step / 2) / volume->db_step;
+        raw = raw > max ? max : raw;
+    }
+    const unsigned int num_values = mixer_ctl_get_num_values(volume->ctl);
+    for (unsigned int i = 0; i < num_values; i++) {
+        mixer_ctl_set_value(volume->ctl, i, raw);
+    }
+    ALOGD("%s: %s = %d for %.3f", __func__, volume->ctl_name, raw, amplitude);
+}
+
 static int adev_set_audio_port_config(struct audio_hw_device *dev,
         const struct audio_port_config *config) {
-    int ret = 0;
+    int ret = -EINVAL;
     struct generic_audio_device *adev = (struct generic_audio_device *)dev;
     const char *bus_address = config->ext.device.address;
+    // adev->lock keeps the bus streams open. SCO streams, which take it under
+    // their own lock, are never in the map.
+    pthread_mutex_lock(&adev->lock);
     struct generic_stream_out *out = hashmapGet(adev->out_bus_stream_map, (void *)bus_address);
-    if (out) {
+    const struct bus_gain *gain =
+            bus_gains_find(adev->bus_gains, bus_address, &adev->default_bus_gain);
+    const unsigned int step = bus_gain_step(gain, config->gain.values[0]);
+
+    // The codec attenuates the whole bus, its streams and patches stay at unity
+    const struct bus_volume *hw_volume = find_bus_volume(adev, bus_address);
+    if (hw_volume) {
+        bus_set_hw_volume(hw_volume, gain, config->gain.values[0]);
+        pthread_mutex_unlock(&adev->lock);
+        return 0;
+    }
+
+    for (; out; out = out->bus_next) {
         pthread_mutex_lock(&out->lock);
-        int gainIndex = (config->gain.values[0] - out->gain_stage.min_value) /
-            out->gain_stage.step_value;
-        int totalSteps = (out->gain_stage.max_value - out->gain_stage.min_value) /
-            out->gain_stage.step_value;
-        float minDb = (float)out->gain_stage.min_value / 100.;
-        float maxDb = (float)out->gain_stage.max_value / 100.;
-        // curve: 10^((minDb + (maxDb - minDb) * gainIndex / totalSteps) / 20)
-        // we should subtract gain at zero gain index to fully silence playback
-        // at zero volume control position, i.e. do:
-        // out->amplitude_ratio = ...
-        //         - pow(10, (minDb + (maxDb - minDb) * (0 / (float)totalSteps)) / 20);
-        out->amplitude_ratio =
-                pow(10, (minDb + (maxDb - minDb) * (gainIndex / (float)totalSteps)) / 20) -
-                pow(10, (minDb) / 20);
+        out->gain_q15 = gain->q15[step];
         pthread_mutex_unlock(&out->lock);
         ALOGD("%s: set audio gain: %f on %s",
-                __func__, out->amplitude_ratio, bus_address);
-    } else {
+                __func__, gain->amplitude[step], bus_address);
+        ret = 0;
+    }
+
+    // Patches the HAL carries into the bus follow its gain
+    for (unsigned int i = 0; i < MAX_AUDIO_PATCHES; i++) {
+        const struct patch_slot *slot = &adev->patches[i];
+        for (unsigned int c = 0; c < slot->num_connections; c++) {
+            const struct patch_connection *connection = &slot->connections[c];
+            if (connection->bridge &&
+                strcmp(slot->patch.sinks[connection->sink].ext.device.address,
+                       bus_address) == 0) {
+                audio_bridge_set_gain(connection->bridge, gain->q15[step]);
+                ALOGD("%s: set audio gain: %f on patch %d", __func__, gain->amplitude[step],
+                      slot->patch.id);
+                ret = 0;
+            }
+        }
+    }
+    pthread_mutex_unlock(&adev->lock);
+    if (ret != 0) {
         ALOGE("%s: can not find output stream by bus_address:%s", __func__, bus_address);
-        ret = -EINVAL;
     }
     return ret;
 }
 
+// Looks up a codec path from source to sink in the platform routing tables
+static const struct hw_route *find_hw_route(struct generic_audio_device *adev,
+        const struct audio_port_config *source, const struct audio_port_config *sink,
+        struct device_card **card) {
+    if (!adev->device_cards || source->type != AUDIO_PORT_TYPE_DEVICE ||
+        sink->type != AUDIO_PORT_TYPE_DEVICE) {
+        return NULL;
+    }
+    for (struct device_card *c = adev->device_cards; c->card != UINT32_MAX; c++) {
+        if (!c->routes || !c->mixer) {
+            continue;
+        }
+        for (const struct hw_route *route = c->routes;
+             route->source != AUDIO_DEVICE_NONE; route++) {
+            if (route->source == source->ext.device.type &&
+                route->sink == sink->ext.device.type &&
+                (!route->sink_address ||
+                 strcmp(route->sink_address, sink->ext.device.address) == 0)) {
+                *card = c;
+                return route;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Programs the codec path for a patch if the platform has one. Call with
+// adev->lock held.
+static const struct hw_route *open_patch_hw_route(struct generic_audio_device *adev,
+        const struct audio_port_config *source, const struct audio_port_config *sink,
+        struct device_card **card) {
+    const struct hw_route *route = find_hw_route(adev, source, sink, card);
+    if (!route) {
+        return NULL;
+    }
+    if (set_route_by_array((*card)->mixer, route->route, 1) != 0) {
+        ALOGE("%s: cannot set the route on card %u", __func__, (*card)->card);
+        set_route_by_array((*card)->mixer, route->route, 0);
+        return NULL;
+    }
+    return route;
+}
+
+// Starts mixing a capture device straight into a bus if the patch is one the
+// HAL can carry. Call with adev->lock held.
+static struct audio_bridge *open_patch_bridge(struct generic_audio_device *adev,
+        const struct audio_port_config *source, const struct audio_port_config *sink) {
+    unsigned int card, device;
+    const struct pcm_config *config;
+    if (sink->type != AUDIO_PORT_TYPE_DEVICE || sink->ext.device.type != AUDIO_DEVICE_OUT_BUS) {
+        return NULL;
+    }
+    switch (source->ext.device.type) {
+    case AUDIO_DEVICE_IN_FM_TUNER:
+        card = platform.in_fm.card;
+        device = platform.in_fm.device;
+        config = platform.in_fm.config;
+        break;
+    case AUDIO_DEVICE_IN_LINE:
+        card = platform.in_aux.card;
+        device = platform.in_aux.device;
+        config = platform.in_aux.config;
+        break;
+    default:
+        return NULL;
+    }
+    if (card == UINT32_MAX || device == UINT32_MAX) {
+        return NULL;
+    }
+
+    struct audio_bridge *bridge = audio_bridge_open(card, device, config,
+            platform.out_default.card, platform.out_default.device, PCM_OUT | PCM_MONOTONIC,
+            &pcm_config_out_default, OUT_WARM_STANDBY_MS, &out_engine_thread_config);
+    if (!bridge) {
+        return NULL;
+    }
+    ext_pcm_set_gain(bridge->ext_pcm, adev->master_gain_q15);
+
+    // Start at the current bus volume
+    int32_t gain_q15 = GAIN_Q15_UNITY;
+    const struct generic_stream_out *out =
+            hashmapGet(adev->out_bus_stream_map, (void *)sink->ext.device.address);
+    const struct bus_gain *gain =
+            bus_gains_find(adev->bus_gains, sink->ext.device.address, &adev->default_bus_gain);
+    const struct bus_volume *hw_volume = find_bus_volume(adev, sink->ext.device.address);
+    if (hw_volume) {
+        if (sink->config_mask & AUDIO_PORT_CONFIG_GAIN) {
+            bus_set_hw_volume(hw_volume, gain, sink->gain.values[0]);
+        }
+    } else if (sink->config_mask & AUDIO_PORT_CONFIG_GAIN) {
+        gain_q15 = gain->q15[bus_gain_step(gain, sink->gain.values[0])];
+    } else if (out) {
+        gain_q15 = out->gain_q15;
+    }
+    audio_bridge_set_gain(bridge, gain_q15);
+    return bridge;
+}
+
+// True if a connection in the patch table still uses the codec path. Call with
+// adev->lock held.
+static bool hw_route_in_use(const struct generic_audio_device *adev,
+        const struct hw_route *route) {
+    for (unsigned int i = 0; i < MAX_AUDIO_PATCHES; i++) {
+        const struct patch_slot *slot = &adev->patches[i];
+        for (unsigned int c = 0; c < slot->num_connections; c++) {
+            if (slot->connections[c].hw_route == route) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Carries every device source of the patch to its sinks: through the codec
+// where the platform has a path, otherwise through a bridge into the first bus
+// sink. Call with adev->lock held.
+static void patch_connect(struct generic_audio_device *adev, struct patch_slot *slot) {
+    const struct audio_patch *patch = &slot->patch;
+    slot->num_connections = 0;
+    for (unsigned int source = 0; source < patch->num_sources; source++) {
+        bool connected = false;
+        for (unsigned int sink = 0; sink < patch->num_sinks &&
+             slot->num_connections < AUDIO_PATCH_PORTS_MAX; sink++) {
+            struct device_card *hw_card = NULL;
+            const struct hw_route *hw_route = open_patch_hw_route(adev,
+                    &patch->sources[source], &patch->sinks[sink], &hw_card);
+            if (hw_route) {
+                slot->connections[slot->num_connections++] = (struct patch_connection) {
+                    .source = source,
+                    .sink = sink,
+                    .hw_card = hw_card,
+                    .hw_route = hw_route,
+                };
+                connected = true;
+            }
+        }
+        // Buses share the output engine, one bridge per source is enough
+        for (unsigned int sink = 0; !connected && sink < patch->num_sinks &&
+             slot->num_connections < AUDIO_PATCH_PORTS_MAX; sink++) {
+            struct audio_bridge *bridge = open_patch_bridge(adev,
+                    &patch->sources[source], &patch->sinks[sink]);
+            if (bridge) {
+                slot->connections[slot->num_connections++] = (struct patch_connection) {
+                    .source = source,
+                    .sink = sink,
+                    .bridge = bridge,
+                };
+                connected = true;
+            }
+        }
+    }
+}
+
+// Stops whatever carries the patch. Call with adev->lock held.
+static void patch_disconnect(struct generic_audio_device *adev, struct patch_slot *slot) {
+    const unsigned int num_connections = slot->num_connections;
+    // Cleared first so hw_route_in_use() only sees the other patches
+    slot->num_connections = 0;
+    for (unsigned int c = 0; c < num_connections; c++) {
+        struct patch_connection *connection = &slot->connections[c];
+        if (connection->bridge) {
+            audio_bridge_close(connection->bridge);
+        }
+        if (connection->hw_route && !hw_route_in_use(adev, connection->hw_route)) {
+            set_route_by_array(connection->hw_card->mixer, connection->hw_route->route, 0);
+        }
+    }
+}
+
+// Slot of a live patch, NULL for unknown or stale handles. Call with
+// adev->lock held.
+static struct patch_slot *patch_slot_from_handle(struct generic_audio_device *adev,
+        audio_patch_handle_t handle) {
+    if (handle <= AUDIO_PATCH_HANDLE_NONE) {
+        return NULL;
+    }
+    struct patch_slot *slot = &adev->patches[handle % MAX_AUDIO_PATCHES];
+    return slot->patch.id == handle ? slot : NULL;
+}
+
 static int adev_create_audio_patch(struct audio_hw_device *dev,
         unsigned int num_sources,
         const struct audio_port_config *sources,
         unsigned int num_sinks,
         const struct audio_port_config *sinks,
         audio_patch_handle_t *handle) {
-    static unsigned int handle_counter = 0;
-    // Logging only, no real work is done here
+    struct generic_audio_device *adev = (struct generic_audio_device *)dev;
     for (unsigned int i = 0; i < num_sources; i++) {
         ALOGD("%s: source[%d] type=%d address=%s", __func__, i, sources[i].type,
                 sources[i].type == AUDIO_PORT_TYPE_DEVICE
@@ -2039,48 +3919,83 @@ static int adev_create_audio_patch(struct audio_hw_device *dev,
                 sinks[i].type == AUDIO_PORT_TYPE_DEVICE ? sinks[i].ext.device.address
                 : "N/A");
     }
-    if (num_sources == 1 && num_sinks == 1 &&
-            sources[0].type == AUDIO_PORT_TYPE_DEVICE &&
-            sinks[0].type == AUDIO_PORT_TYPE_DEVICE) {
-        // The same audio_patch_handle_t will be passed to release_audio_patch
-        *handle = handle_counter;
-        patch_list* item = (patch_list*)malloc(sizeof(patch_list));
-
-        item->patch.id = handle_counter;
-        item->patch.num_sources = num_sources;
-        memcpy(item->patch.sources, sources, sizeof(struct audio_port_config) * num_sources);
-        item->patch.num_sinks = num_sinks;
-        memcpy(item->patch.sinks, sinks, sizeof(struct audio_port_config) * num_sinks);
-        list_init(&item->list);
-        if (!patch_head)
-            patch_head = &item->list;
-        else
-            list_add_tail(patch_head, &item->list);
-        ALOGD("%s: handle: %d", __func__, *handle);
+    if (num_sources == 0 || num_sources > AUDIO_PATCH_PORTS_MAX ||
+        num_sinks == 0 || num_sinks > AUDIO_PATCH_PORTS_MAX) {
+        return -EINVAL;
+    }
 
-        ++handle_counter;
+    pthread_mutex_lock(&adev->lock);
+    // The framework passes the handle of a patch it updates in place
+    struct patch_slot *slot = patch_slot_from_handle(adev, *handle);
+    if (slot) {
+        patch_disconnect(adev, slot);
+    } else {
+        if (adev->num_free_patches == 0) {
+            pthread_mutex_unlock(&adev->lock);
+            ALOGE("%s: all %d patches are in use", __func__, MAX_AUDIO_PATCHES);
+            return -ENOSPC;
+        }
+        const unsigned int index = adev->free_patches[--adev->num_free_patches];
+        slot = &adev->patches[index];
+        slot->patch.id = slot->generation * MAX_AUDIO_PATCHES + index;
     }
 
+    slot->patch.num_sources = num_sources;
+    memcpy(slot->patch.sources, sources, sizeof(struct audio_port_config) * num_sources);
+    slot->patch.num_sinks = num_sinks;
+    memcpy(slot->patch.sinks, sinks, sizeof(struct audio_port_config) * num_sinks);
+    patch_connect(adev, slot);
+    // The same audio_patch_handle_t will be passed to release_audio_patch
+    *handle = slot->patch.id;
+    ALOGD("%s: handle: %d, %u connections", __func__, *handle, slot->num_connections);
+    pthread_mutex_unlock(&adev->lock);
     return 0;
 }
 
 static int adev_release_audio_patch(struct audio_hw_device *dev,
         audio_patch_handle_t handle) {
-    if (!patch_head)
-        return 0;
-
-    struct listnode* node;
-    list_for_each(node, patch_head) {
-        patch_list* item = node_to_item(node, patch_list, list);
-        if (item->patch.id == handle) {
-            list_remove(node);
-            free(item);
-        }
+    struct generic_audio_device *adev = (struct generic_audio_device *)dev;
+    pthread_mutex_lock(&adev->lock);
+    struct patch_slot *slot = patch_slot_from_handle(adev, handle);
+    if (!slot) {
+        pthread_mutex_unlock(&adev->lock);
+        ALOGE("%s: unknown handle: %d", __func__, handle);
+        return -EINVAL;
     }
+    patch_disconnect(adev, slot);
+    slot->patch.id = AUDIO_PATCH_HANDLE_NONE;
+    // Handles stay positive; generation 0 is never used
+    if (++slot->generation > INT32_MAX / MAX_AUDIO_PATCHES - 1) {
+        slot->generation = 1;
+    }
+    adev->free_patches[adev->num_free_patches++] = slot - adev->patches;
+    pthread_mutex_unlock(&adev->lock);
     ALOGD("%s: handle: %d", __func__, handle);
     return 0;
 }
 
+// Microphone of the board description, with no channel mapping
+static void describe_microphone(struct audio_microphone_characteristic_t *mic,
+                                const struct mic_array_mic *desc, unsigned int index)
+{
+    memset(mic, 0, sizeof(*mic));
+    strncpy(mic->device_id, desc->id, AUDIO_MICROPHONE_ID_MAX_LEN - 1);
+    mic->device = AUDIO_DEVICE_IN_BUILTIN_MIC;
+    strncpy(mic->address, AUDIO_BOTTOM_MICROPHONE_ADDRESS, AUDIO_DEVICE_MAX_ADDRESS_LEN - 1);
+    memset(mic->channel_mapping, AUDIO_MICROPHONE_CHANNEL_MAPPING_UNUSED,
+           sizeof(mic->channel_mapping));
+    mic->location = desc->location;
+    mic->group = 0;
+    mic->index_in_the_group = index;
+    mic->sensitivity = AUDIO_MICROPHONE_SENSITIVITY_UNKNOWN;
+    mic->max_spl = AUDIO_MICROPHONE_SPL_UNKNOWN;
+    mic->min_spl = AUDIO_MICROPHONE_SPL_UNKNOWN;
+    mic->directionality = desc->directionality;
+    mic->num_frequency_responses = 0;
+    mic->geometric_location = desc->position;
+    mic->orientation = desc->orientation;
+}
+
 static int adev_get_microphones(const audio_hw_device_t * dev,
                                 struct audio_microphone_characteristic_t *mic_array,
                                 size_t *mic_count)
@@ -2089,8 +4004,9 @@ static int adev_get_microphones(const audio_hw_device_t * dev,
         return -ENOSYS;
     }
 
+    const size_t num_mics = platform.mics.num_mics > 0 ? platform.mics.num_mics : 1;
     if (*mic_count == 0) {
-        *mic_count = 1;
+        *mic_count = num_mics;
         return 0;
     }
 
@@ -2098,6 +4014,16 @@ static int adev_get_microphones(const audio_hw_device_t * dev,
         return -ENOSYS;
     }
 
+    if (platform.mics.num_mics > 0) {
+        if (*mic_count > num_mics) {
+            *mic_count = num_mics;
+        }
+        for (size_t i = 0; i < *mic_count; i++) {
+            describe_microphone(&mic_array[i], &platform.mics.mics[i], i);
+        }
+        return 0;
+    }
+
     strncpy(mic_array->device_id, "mic_renesas", AUDIO_MICROPHONE_ID_MAX_LEN - 1);
     mic_array->device = AUDIO_DEVICE_IN_BUILTIN_MIC;
     strncpy(mic_array->address, AUDIO_BOTTOM_MICROPHONE_ADDRESS,
@@ -2138,12 +4064,24 @@ static int adev_close(hw_device_t *dev) {
     }
 
     if ((--audio_device_ref_count) == 0) {
+        close_hfp_handles(adev);
+        pthread_mutex_lock(&adev->lock);
+        for (unsigned int i = 0; i < MAX_AUDIO_PATCHES; i++) {
+            patch_disconnect(adev, &adev->patches[i]);
+        }
+        pthread_mutex_unlock(&adev->lock);
+        pthread_cond_destroy(&adev->hfp_call.ready);
+        pthread_mutex_destroy(&adev->hfp_call.ready_lock);
+        pthread_mutex_destroy(&adev->capture_volume_lock);
         if (adev->device_cards) {
             close_mixers_by_array(adev->device_cards);
         }
+        audio_platform_release(&platform, cards);
         if (adev->out_bus_stream_map) {
             hashmapFree(adev->out_bus_stream_map);
         }
+        bus_gains_release(adev->bus_gains);
+        bus_gain_release(&adev->default_bus_gain);
         free(adev);
     }
 
@@ -2191,6 +4129,21 @@ static int adev_open(const hw_module_t *module,
     adev = calloc(1, sizeof(struct generic_audio_device));
 
     pthread_mutex_init(&adev->lock, (const pthread_mutexattr_t *) NULL);
+    pthread_mutex_init(&adev->capture_volume_lock, (const pthread_mutexattr_t *) NULL);
+
+    // Slot 0 is handed out first
+    for (unsigned int i = 0; i < MAX_AUDIO_PATCHES; i++) {
+        adev->patches[i].generation = 1;
+        adev->free_patches[i] = MAX_AUDIO_PATCHES - 1 - i;
+    }
+    adev->num_free_patches = MAX_AUDIO_PATCHES;
+
+    pthread_condattr_t ready_attr;
+    pthread_condattr_init(&ready_attr);
+    pthread_condattr_setclock(&ready_attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&adev->hfp_call.ready_lock, (const pthread_mutexattr_t *) NULL);
+    pthread_cond_init(&adev->hfp_call.ready, &ready_attr);
+    pthread_condattr_destroy(&ready_attr);
 
     adev->device.common.tag = HARDWARE_DEVICE_TAG;
     adev->device.common.version = AUDIO_DEVICE_API_VERSION_3_0;
@@ -2199,15 +4152,15 @@ static int adev_open(const hw_module_t *module,
 
     adev->device.init_check = adev_init_check;               // no op
     adev->device.set_voice_volume = adev_set_voice_volume;   // no op
-    adev->device.set_master_volume = adev_set_master_volume; // no op
-    adev->device.get_master_volume = adev_get_master_volume; // no op
+    adev->device.set_master_volume = adev_set_master_volume;
+    adev->device.get_master_volume = adev_get_master_volume;
     adev->device.set_master_mute = adev_set_master_mute;
     adev->device.get_master_mute = adev_get_master_mute;
     adev->device.set_mode = adev_set_mode;                   // no op
     adev->device.set_mic_mute = adev_set_mic_mute;
     adev->device.get_mic_mute = adev_get_mic_mute;
-    adev->device.set_parameters = adev_set_parameters;       // no op
-    adev->device.get_parameters = adev_get_parameters;       // no op
+    adev->device.set_parameters = adev_set_parameters;
+    adev->device.get_parameters = adev_get_parameters;
     adev->device.get_input_buffer_size = adev_get_input_buffer_size;
     adev->device.open_output_stream = adev_open_output_stream;
     adev->device.close_output_stream = adev_close_output_stream;
@@ -2224,19 +4177,47 @@ static int adev_open(const hw_module_t *module,
     *device = &adev->device.common;
 
     //common version
-    adev->device_cards = cards;
+    audio_platform_load(&platform, AUDIO_PLATFORM_INFO_PATH);
+    if (platform.out_fast.card == UINT32_MAX || platform.out_fast.device == UINT32_MAX) {
+        // Fast streams then share the default engine and must match its format
+        pcm_config_out_fast.channels = pcm_config_out_default.channels;
+        pcm_config_out_fast.rate = pcm_config_out_default.rate;
+    }
+    adev->device_cards = platform.cards;
     if (open_mixers_by_array(adev->device_cards) != 0) {
+        audio_platform_release(&platform, cards);
         free(adev);
         ALOGE("Unable to open and setup some mixers, aborting.");
         return -EINVAL;
     }
 
     adev->mode = AUDIO_MODE_NORMAL;
+    adev->hfp_call.sample_rate = DEFAULT_HFP_SAMPLING_RATE;
+    adev->hfp_call.hfp_volume = HFP_VOLUME_MAX;
+    adev->hfp_call.hfp_gain = GAIN_Q15_UNITY;
+    for (unsigned int ch = 0; ch < MIC_TRIM_MAX_CHANNELS; ch++) {
+        atomic_init(&adev->mic_trim_q15[ch], GAIN_Q15_UNITY);
+    }
+    adev->master_volume = 1.0f;
+    adev->master_gain_q15 = EXT_PCM_GAIN_UNITY;
 
     // Initialize the bus address to output stream map
     adev->out_bus_stream_map = hashmapCreate(5, str_hash_fn, str_eq);
 
+    // Gain tables of every bus, worked out once
+    adev->bus_gains = bus_gains_load(AUDIO_POLICY_CONFIG_PATH);
+    bus_gain_init(&adev->default_bus_gain, NULL, &bus_gain_stage_default);
+
     audio_device_ref_count++;
+    pthread_mutex_unlock(&adev_init_lock);
+
+    // Pre-create the HFP bridge so an incoming call does not pay for
+    // stream creation and worker start-up. Stream creation does not need
+    // adev_init_lock and may take a while.
+    if (platform.out_hfp.card != UINT32_MAX) {
+        open_hfp_handles(adev);
+    }
+    return 0;
 
 unlock:
     pthread_mutex_unlock(&adev_init_lock);
@@ -26,7 +26,10 @@
 #include <audio_utils/resampler.h>
 
 #include "platform/audio_hal_types.h"
+#include "audio_seqlock.h"
 #include "audio_vbuffer.h"
+#include "bus_gain.h"
+#include "mic_array.h"
 
 struct hfp_call {
     struct generic_stream_in *mic_input;
@@ -34,22 +37,70 @@ struct hfp_call {
     struct generic_stream_out *hfp_output;
     struct generic_stream_out *headset_output;
 
-    unsigned int hfp_volume;
+    unsigned int hfp_volume;    // Protected by dev->lock
+    int32_t hfp_gain;           // Q15 gain for hfp_volume, protected by dev->lock
+    unsigned int sample_rate;   // Protected by dev->lock
 
-    uint8_t stream_flag;
+    // Leaf lock, the output engines set stream_flag with sources_lock and
+    // out->lock held, so nothing else may be acquired while holding it
+    pthread_mutex_t ready_lock;
+    uint8_t stream_flag;     // Protected by ready_lock
+    pthread_cond_t ready;    // Signalled whenever stream_flag changes
+    bool active;             // Protected by dev->lock
+};
+
+// Channels of the microphone PCM that can be trimmed, see adev->mic_trim_q15
+#define MIC_TRIM_MAX_CHANNELS 8
+
+// Patches open at the same time, a car routes every bus and zone through one
+#define MAX_AUDIO_PATCHES 32
+
+// A device source carried to a device sink by the codec or by the HAL
+struct patch_connection {
+    unsigned int source;              // Index in patch.sources
+    unsigned int sink;                // Index in patch.sinks
+    struct audio_bridge *bridge;      // NULL unless the HAL carries the audio
+    struct device_card *hw_card;      // Card of hw_route
+    const struct hw_route *hw_route;  // NULL unless the codec carries the audio
+};
+
+// Slot of the patch table. The handle of a patch is
+// generation * MAX_AUDIO_PATCHES + slot index, so a stale handle never
+// resolves to a patch created later in the same slot.
+struct patch_slot {
+    struct audio_patch patch;         // patch.id is AUDIO_PATCH_HANDLE_NONE while free
+    unsigned int generation;          // Bumped on release
+    unsigned int num_connections;
+    struct patch_connection connections[AUDIO_PATCH_PORTS_MAX];
 };
 
 struct generic_audio_device {
   struct audio_hw_device device;  // Constant after init
   pthread_mutex_t lock;
   bool master_mute;             // Proteced by this->lock
+  float master_volume;          // Proteced by this->lock
+  int32_t master_gain_q15;      // Same in Q15, protected by this->lock
   bool mic_mute;                // Proteced by this->lock
   struct device_card *device_cards;
   Hashmap *out_bus_stream_map;  // Extended field. Constant after init
+  struct bus_gain *bus_gains;   // Constant after init, NULL if the policy has none
+  struct bus_gain default_bus_gain;  // Constant after init, for buses without a stage
   audio_mode_t mode;
 
   struct hfp_call hfp_call;
 
+  // Users and gain of the capture volumes of device_cards. Taken by the
+  // capture workers every period, so it is never held across anything slow.
+  pthread_mutex_t capture_volume_lock;
+
+  // Per channel gain of the microphone PCM, matches the mics of an array
+  audio_seqlock_t mic_trim_lock;                  // Writers hold this->lock
+  atomic_int mic_trim_q15[MIC_TRIM_MAX_CHANNELS]; // Read under mic_trim_lock
+
+  struct patch_slot patches[MAX_AUDIO_PATCHES];   // Protected by this->lock
+  unsigned int free_patches[MAX_AUDIO_PATCHES];   // Free slot stack, protected by this->lock
+  unsigned int num_free_patches;                  // Protected by this->lock
+
   int64_t sleep_ms;
 };
 
@@ -62,8 +113,9 @@ struct generic_stream_out {
   struct pcm_config pcm_config;      // Constant after init
   audio_vbuffer_t buffer;            // Protected by this->lock
   char *bus_address;                 // Extended field. Constant after init
-  struct audio_gain gain_stage;      // Constant after init
-  float amplitude_ratio;             // Protected by this->lock
+  struct generic_stream_out *bus_next;  // Next stream on the same bus, protected by dev->lock
+  const struct bus_gain *gain;       // Constant after init, NULL if not on a bus
+  int32_t gain_q15;                  // Protected by this->lock
 
   // Time & Position Keeping
   bool standby;                    // Protected by this->lock
@@ -73,15 +125,53 @@ struct generic_stream_out {
   uint64_t frames_total_buffered;  // Protected by this->lock
   uint64_t frames_written;         // Protected by this->lock
   uint64_t frames_rendered;        // Protected by this->lock
-
-  // Worker
-  pthread_t worker_thread;     // Constant after init
-  pthread_cond_t worker_wake;  // Protected by this->lock
-  bool worker_standby;         // Protected by this->lock
-  bool worker_exit;            // Protected by this->lock
+  uint64_t frames_consumed;        // Protected by this->lock, at the PCM rate
+
+  // Where the engine put the last frames it pulled, published by the engine
+  // so the presentation position can be read without this->lock
+  audio_seqlock_t position_lock;          // Writers hold this->lock
+  atomic_uint_least64_t pull_position;    // Engine frame of the last pull
+  atomic_uint_least64_t pull_consumed;    // frames_consumed before the last pull
+  atomic_uint pull_frames;                // Frames of the last pull
+  atomic_uint_least64_t consumed_base;    // frames_consumed at the last flush
+
+  // MMAP streams bypass the output engine
+  struct audio_mmap *mmap;     // Constant after init, NULL if not MMAP
+
+  // Output engine
+  struct ext_pcm *ext_pcm;     // Constant after init
+  void *scratch;               // Constant after init, backs the buffers below
+  void *period_buffer;         // Protected by this->lock
+  bool draining;               // Protected by this->lock
+  unsigned int drain_periods;  // Protected by this->lock
+
+  // Pause, drain and callbacks
+  bool paused;                        // Protected by this->lock
+  bool write_blocked;                 // Protected by this->lock, WRITE_READY is owed
+  bool drain_requested;               // Protected by this->lock
+  bool drain_ready;                   // Protected by this->lock, DRAIN_READY is owed
+  pthread_cond_t drained;             // Signalled when drain_requested is cleared
+  stream_callback_t callback;         // Protected by this->lock
+  void *callback_cookie;              // Protected by this->lock
+
+  // Worker, started for batched streams and by set_callback(). Posts the
+  // stream callbacks and converts PCM batches.
+  pthread_t worker_thread;            // Protected by this->lock
+  bool worker_running;                // Protected by this->lock
+  pthread_cond_t worker_wake;         // Protected by this->lock
+  bool worker_exit;                   // Protected by this->lock
+
+  // Batched streams queue large batches in batch_queue, the worker
+  // converts them into buffer for the engine
+  bool batched;                       // Constant after init
+  audio_vbuffer_t batch_queue;        // Protected by this->lock
+  unsigned int batch_generation;      // Protected by this->lock, bumped by flush
+  void *batch;                        // Owned by the worker
+  void *batch_resampled;              // Owned by the worker
 
   // Resampling
-  struct resampler_itfe *resampler; // Protected by this->lock
+  struct resampler_itfe *resampler; // Protected by this->lock, owned by the
+                                    // worker for batched streams
   void *resampler_buffer;           // Protected by this->lock
   //size_t resampler_buffer_frame_count;
 };
@@ -96,6 +186,8 @@ struct generic_stream_in {
   struct pcm_config pcm_config;      // Constant after init
   audio_vbuffer_t buffer;            // Protected by this->lock
   char *bus_address;                 // Extended field. Constant after init
+  float gain;                        // Set by in_set_gain(), protected by this->lock
+  int32_t gain_q15;                  // Same in Q15, protected by this->lock
 
   // Time & Position Keeping
   bool standby;                       // Protected by this->lock
@@ -103,11 +195,23 @@ struct generic_stream_in {
   struct timespec standby_exit_time;  // Protected by this->lock
   int64_t standby_frames_read;        // Protected by this->lock
 
+  // MMAP streams have no worker
+  struct audio_mmap *mmap;     // Constant after init, NULL if not MMAP
+
   // Worker
   pthread_t worker_thread;     // Constant after init
   pthread_cond_t worker_wake;  // Protected by this->lock
   bool worker_standby;         // Protected by this->lock
   bool worker_exit;            // Protected by this->lock
+  bool pcm_reconfigure;        // Protected by this->lock
+  void *scratch;               // Constant after init, backs the buffers below
+  void *period_buffer;         // Owned by the worker
+  void *adjust_buffer;         // Owned by the worker
+  void *beam_history;          // Owned by the worker, backs beamformer
+
+  // Steers the microphones into the requested channels
+  bool beamforming;                // Constant after init
+  struct beamformer beamformer;    // Owned by the worker
 
   // Resampling
   struct resampler_itfe *resampler; // Protected by this->lock
@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2019 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_generic"
+
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+
+#include <log/log.h>
+
+#include "audio_mmap.h"
+
+void audio_mmap_init(struct audio_mmap *mmap, unsigned int card, unsigned int device,
+                     unsigned int flags, const struct pcm_config *config,
+                     unsigned int period_count_min, unsigned int period_count_max) {
+    memset(mmap, 0, sizeof(*mmap));
+    mmap->card = card;
+    mmap->device = device;
+    mmap->flags = flags;
+    mmap->config = *config;
+    mmap->period_count_min = period_count_min;
+    mmap->period_count_max = period_count_max;
+}
+
+int audio_mmap_create_buffer(struct audio_mmap *mmap, int32_t min_size_frames,
+                             struct audio_mmap_buffer_info *info) {
+    if (min_size_frames <= 0 || info == NULL) {
+        return -EINVAL;
+    }
+    if (mmap->pcm) {
+        ALOGE("%s: buffer already created", __func__);
+        return -ENOSYS;
+    }
+
+    struct pcm_config *config = &mmap->config;
+    unsigned int period_count =
+        (min_size_frames + config->period_size - 1) / config->period_size;
+    if (period_count < mmap->period_count_min) {
+        period_count = mmap->period_count_min;
+    } else if (period_count > mmap->period_count_max) {
+        period_count = mmap->period_count_max;
+    }
+    config->period_count = period_count;
+    // The client runs the buffer on its own, the driver must neither start
+    // nor stop on fill level
+    config->start_threshold = 0;
+    config->stop_threshold = INT_MAX;
+    config->silence_threshold = 0;
+    config->silence_size = 0;
+    config->avail_min = config->period_size;
+
+    mmap->pcm = pcm_open(mmap->card, mmap->device,
+                         mmap->flags | PCM_MMAP | PCM_NOIRQ | PCM_MONOTONIC, config);
+    if (!pcm_is_ready(mmap->pcm)) {
+        ALOGE("%s: pcm_open(%u, %u) failed: %s", __func__, mmap->card, mmap->device,
+              pcm_get_error(mmap->pcm));
+        goto error;
+    }
+
+    unsigned int offset = 0;
+    unsigned int frames = pcm_get_buffer_size(mmap->pcm);
+    if (pcm_mmap_begin(mmap->pcm, &info->shared_memory_address, &offset, &frames) < 0 ||
+            offset != 0) {
+        ALOGE("%s: pcm_mmap_begin failed: %s", __func__, pcm_get_error(mmap->pcm));
+        goto error;
+    }
+
+    info->buffer_size_frames = pcm_get_buffer_size(mmap->pcm);
+    info->burst_size_frames = config->period_size;
+    // The DMA area is at offset 0 of the PCM node, so the client maps the
+    // same descriptor the HAL uses
+    info->shared_memory_fd = pcm_get_poll_fd(mmap->pcm);
+
+    if (mmap->flags & PCM_IN) {
+        pcm_mmap_commit(mmap->pcm, 0, 0);
+    } else {
+        memset(info->shared_memory_address, 0,
+               pcm_frames_to_bytes(mmap->pcm, info->buffer_size_frames));
+        // Nothing checks the fill level, start from a full buffer of silence
+        pcm_mmap_commit(mmap->pcm, 0, info->buffer_size_frames);
+    }
+
+    ALOGD("%s: card %u device %u buffer %d frames burst %d frames", __func__,
+          mmap->card, mmap->device, info->buffer_size_frames, info->burst_size_frames);
+    return 0;
+
+error:
+    if (mmap->pcm) {
+        pcm_close(mmap->pcm);
+        mmap->pcm = NULL;
+    }
+    return -ENODEV;
+}
+
+int audio_mmap_get_position(struct audio_mmap *mmap, struct audio_mmap_position *position) {
+    if (!mmap->pcm) {
+        return -ENOSYS;
+    }
+
+    unsigned int hw_ptr = 0;
+    struct timespec ts = { .tv_sec = 0, .tv_nsec = 0 };
+    int ret = pcm_mmap_get_hw_ptr(mmap->pcm, &hw_ptr, &ts);
+    if (ret < 0) {
+        return ret;
+    }
+    position->position_frames = hw_ptr;
+    position->time_nanoseconds = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    return 0;
+}
+
+int audio_mmap_start(struct audio_mmap *mmap) {
+    if (!mmap->pcm) {
+        return -ENOSYS;
+    }
+    if (mmap->started) {
+        return 0;
+    }
+
+    int ret = pcm_start(mmap->pcm);
+    if (ret < 0) {
+        ALOGE("%s: pcm_start failed: %s", __func__, pcm_get_error(mmap->pcm));
+        return -EIO;
+    }
+    mmap->started = true;
+    return 0;
+}
+
+int audio_mmap_stop(struct audio_mmap *mmap) {
+    if (!mmap->pcm) {
+        return -ENOSYS;
+    }
+    if (!mmap->started) {
+        return 0;
+    }
+
+    mmap->started = false;
+    int ret = pcm_stop(mmap->pcm);
+    if (ret < 0) {
+        ALOGE("%s: pcm_stop failed: %s", __func__, pcm_get_error(mmap->pcm));
+        return -EIO;
+    }
+    return 0;
+}
+
+void audio_mmap_close(struct audio_mmap *mmap) {
+    if (mmap->pcm) {
+        audio_mmap_stop(mmap);
+        pcm_close(mmap->pcm);
+        mmap->pcm = NULL;
+    }
+}
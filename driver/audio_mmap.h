@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2019 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AUDIO_MMAP_H
+#define AUDIO_MMAP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <hardware/audio.h>
+#include <tinyalsa/asoundlib.h>
+
+// ALSA PCM opened in MMAP/no-IRQ mode whose DMA area is shared with the
+// client (AAudio) through the PCM file descriptor. The client reads and
+// writes the buffer directly, the HAL only starts, stops and reports the
+// hardware position.
+struct audio_mmap {
+    unsigned int card;          // Constant after init
+    unsigned int device;        // Constant after init
+    unsigned int flags;         // PCM_OUT or PCM_IN, constant after init
+    struct pcm_config config;   // period_count is fitted in create_buffer
+    unsigned int period_count_min;
+    unsigned int period_count_max;
+    struct pcm *pcm;
+    bool started;
+};
+
+void audio_mmap_init(struct audio_mmap *mmap, unsigned int card, unsigned int device,
+                     unsigned int flags, const struct pcm_config *config,
+                     unsigned int period_count_min, unsigned int period_count_max);
+int audio_mmap_create_buffer(struct audio_mmap *mmap, int32_t min_size_frames,
+                             struct audio_mmap_buffer_info *info);
+int audio_mmap_get_position(struct audio_mmap *mmap, struct audio_mmap_position *position);
+int audio_mmap_start(struct audio_mmap *mmap);
+int audio_mmap_stop(struct audio_mmap *mmap);
+void audio_mmap_close(struct audio_mmap *mmap);
+
+#endif  // AUDIO_MMAP_H
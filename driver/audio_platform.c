@@ -0,0 +1,601 @@
+/*
+ * Copyright (C) 2019 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_generic"
+
+#include <errno.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <expat.h>
+#include <log/log.h>
+
+#include "audio_platform.h"
+
+#define PLATFORM_READ_SIZE 4096
+
+static const struct {
+    const char *name;
+    size_t offset;
+} platform_pcms[] = {
+    { "out_default", offsetof(struct audio_platform, out_default) },
+    { "out_hfp", offsetof(struct audio_platform, out_hfp) },
+    { "out_fast", offsetof(struct audio_platform, out_fast) },
+    { "out_mmap", offsetof(struct audio_platform, out_mmap) },
+    { "in_default", offsetof(struct audio_platform, in_default) },
+    { "in_fm", offsetof(struct audio_platform, in_fm) },
+    { "in_aux", offsetof(struct audio_platform, in_aux) },
+    { "in_hfp", offsetof(struct audio_platform, in_hfp) },
+    { "in_mmap", offsetof(struct audio_platform, in_mmap) },
+};
+
+#define PLATFORM_PCM_COUNT (sizeof(platform_pcms) / sizeof(platform_pcms[0]))
+
+// A mixer default, or the volume control of a bus if bus is set
+struct platform_ctl {
+    unsigned int card_index;
+    char *name;
+    int intval;
+    char *strval;
+    char *bus;
+    int db_min;
+    int db_step;
+};
+
+// Built in description as found by audio_platform_load(), before the file
+// and the HAL changed any of it
+struct platform_builtin {
+    struct audio_platform_pcm pcm[PLATFORM_PCM_COUNT];
+    struct pcm_config pcm_config[PLATFORM_PCM_COUNT];
+    struct mic_array mics;
+};
+
+// Everything is staged here and only applied once the whole file parsed
+struct platform_parser {
+    XML_Parser parser;
+    int error;
+
+    unsigned int pcm_card[PLATFORM_PCM_COUNT];
+    unsigned int pcm_device[PLATFORM_PCM_COUNT];
+    struct pcm_config pcm_config[PLATFORM_PCM_COUNT];
+
+    unsigned int *card_ids;
+    unsigned int num_cards;
+    int current_card;               // Index in card_ids, -1 outside <card>
+
+    struct platform_ctl *ctls;
+    unsigned int num_ctls;
+    unsigned int num_volumes;       // ctls that are bus volumes
+
+    struct mic_array mics;
+    bool has_mics;                  // Any <microphone>, which replaces the built in ones
+};
+
+static const struct {
+    const char *name;
+    audio_microphone_location_t value;
+} mic_locations[] = {
+    { "mainbody", AUDIO_MICROPHONE_LOCATION_MAINBODY },
+    { "mainbody_movable", AUDIO_MICROPHONE_LOCATION_MAINBODY_MOVABLE },
+    { "peripheral", AUDIO_MICROPHONE_LOCATION_PERIPHERAL },
+};
+
+static const struct {
+    const char *name;
+    audio_microphone_directionality_t value;
+} mic_directionalities[] = {
+    { "omni", AUDIO_MICROPHONE_DIRECTIONALITY_OMNI },
+    { "bi_directional", AUDIO_MICROPHONE_DIRECTIONALITY_BI_DIRECTIONAL },
+    { "cardioid", AUDIO_MICROPHONE_DIRECTIONALITY_CARDIOID },
+    { "hyper_cardioid", AUDIO_MICROPHONE_DIRECTIONALITY_HYPER_CARDIOID },
+    { "super_cardioid", AUDIO_MICROPHONE_DIRECTIONALITY_SUPER_CARDIOID },
+};
+
+static struct audio_platform_pcm *platform_pcm(struct audio_platform *platform,
+                                               unsigned int index) {
+    return (struct audio_platform_pcm *)((char *)platform + platform_pcms[index].offset);
+}
+
+static const char *find_attr(const XML_Char **attrs, const char *name) {
+    for (unsigned int i = 0; attrs[i]; i += 2) {
+        if (strcmp(attrs[i], name) == 0) {
+            return attrs[i + 1];
+        }
+    }
+    return NULL;
+}
+
+static int parse_uint(const char *value, unsigned int *result) {
+    char *end;
+    if (!value || !*value) {
+        return -EINVAL;
+    }
+    errno = 0;
+    unsigned long parsed = strtoul(value, &end, 0);
+    if (errno != 0 || *end != '\0' || parsed > UINT32_MAX) {
+        return -EINVAL;
+    }
+    *result = parsed;
+    return 0;
+}
+
+static int parse_int(const char *value, int *result) {
+    char *end;
+    if (!value || !*value) {
+        return -EINVAL;
+    }
+    errno = 0;
+    long parsed = strtol(value, &end, 0);
+    if (errno != 0 || *end != '\0' || parsed < INT32_MIN || parsed > INT32_MAX) {
+        return -EINVAL;
+    }
+    *result = parsed;
+    return 0;
+}
+
+// Parses an optional attribute, leaving result as is if it is missing
+static int parse_uint_attr(const XML_Char **attrs, const char *name, unsigned int *result) {
+    const char *value = find_attr(attrs, name);
+    return value ? parse_uint(value, result) : 0;
+}
+
+// Parses an optional attribute in meters, leaving result as is if it is missing
+static int parse_float_attr(const XML_Char **attrs, const char *name, float *result) {
+    const char *value = find_attr(attrs, name);
+    char *end;
+    if (!value) {
+        return 0;
+    }
+    errno = 0;
+    const float parsed = strtof(value, &end);
+    if (errno != 0 || !*value || *end != '\0' || !isfinite(parsed)) {
+        return -EINVAL;
+    }
+    *result = parsed;
+    return 0;
+}
+
+static int parse_coordinate_attrs(const XML_Char **attrs, const char *prefix,
+                                  struct audio_microphone_coordinate *coordinate) {
+    char name[32];
+    snprintf(name, sizeof(name), "%sx", prefix);
+    if (parse_float_attr(attrs, name, &coordinate->x) != 0) {
+        return -EINVAL;
+    }
+    snprintf(name, sizeof(name), "%sy", prefix);
+    if (parse_float_attr(attrs, name, &coordinate->y) != 0) {
+        return -EINVAL;
+    }
+    snprintf(name, sizeof(name), "%sz", prefix);
+    return parse_float_attr(attrs, name, &coordinate->z);
+}
+
+static void parser_fail(struct platform_parser *state, const char *what) {
+    ALOGE("%s: line %lu: %s", __func__, XML_GetCurrentLineNumber(state->parser), what);
+    state->error = -EINVAL;
+    XML_StopParser(state->parser, XML_FALSE);
+}
+
+static void parse_pcm(struct platform_parser *state, const XML_Char **attrs) {
+    const char *name = find_attr(attrs, "name");
+    unsigned int index;
+    for (index = 0; index < PLATFORM_PCM_COUNT; index++) {
+        if (name && strcmp(platform_pcms[index].name, name) == 0) {
+            break;
+        }
+    }
+    if (index == PLATFORM_PCM_COUNT) {
+        parser_fail(state, "unknown pcm name");
+        return;
+    }
+    struct pcm_config *config = &state->pcm_config[index];
+    if (parse_uint_attr(attrs, "card", &state->pcm_card[index]) != 0 ||
+        parse_uint_attr(attrs, "device", &state->pcm_device[index]) != 0 ||
+        parse_uint_attr(attrs, "channels", &config->channels) != 0 ||
+        parse_uint_attr(attrs, "rate", &config->rate) != 0 ||
+        parse_uint_attr(attrs, "period_size", &config->period_size) != 0 ||
+        parse_uint_attr(attrs, "period_count", &config->period_count) != 0 ||
+        config->channels == 0 || config->rate == 0 ||
+        config->period_size == 0 || config->period_count == 0) {
+        parser_fail(state, "bad pcm attribute");
+    }
+}
+
+static void parse_card(struct platform_parser *state, const XML_Char **attrs) {
+    unsigned int id;
+    if (state->current_card >= 0) {
+        parser_fail(state, "nested card");
+        return;
+    }
+    if (parse_uint(find_attr(attrs, "id"), &id) != 0 || id == UINT32_MAX) {
+        parser_fail(state, "bad card id");
+        return;
+    }
+    unsigned int *card_ids = realloc(state->card_ids,
+                                     (state->num_cards + 1) * sizeof(unsigned int));
+    if (!card_ids) {
+        parser_fail(state, "out of memory");
+        return;
+    }
+    state->card_ids = card_ids;
+    state->card_ids[state->num_cards] = id;
+    state->current_card = state->num_cards++;
+}
+
+static void parse_ctl(struct platform_parser *state, const XML_Char **attrs) {
+    const char *name = find_attr(attrs, "name");
+    const char *value = find_attr(attrs, "value");
+    const char *strval = find_attr(attrs, "enum");
+    char *end;
+    if (state->current_card < 0) {
+        parser_fail(state, "ctl outside of card");
+        return;
+    }
+    if (!name || !*name || (!value == !strval)) {
+        parser_fail(state, "ctl needs a name and either value or enum");
+        return;
+    }
+    struct platform_ctl ctl = {
+        .card_index = state->current_card,
+    };
+    if (value) {
+        errno = 0;
+        ctl.intval = strtol(value, &end, 0);
+        if (errno != 0 || !*value || *end != '\0') {
+            parser_fail(state, "bad ctl value");
+            return;
+        }
+    }
+    struct platform_ctl *ctls = realloc(state->ctls,
+                                        (state->num_ctls + 1) * sizeof(struct platform_ctl));
+    if (!ctls) {
+        parser_fail(state, "out of memory");
+        return;
+    }
+    state->ctls = ctls;
+    ctl.name = strdup(name);
+    ctl.strval = strval ? strdup(strval) : NULL;
+    state->ctls[state->num_ctls++] = ctl;
+    if (!ctl.name || (strval && !ctl.strval)) {
+        parser_fail(state, "out of memory");
+    }
+}
+
+static void parse_volume(struct platform_parser *state, const XML_Char **attrs) {
+    const char *bus = find_attr(attrs, "bus");
+    const char *name = find_attr(attrs, "ctl");
+    if (state->current_card < 0) {
+        parser_fail(state, "volume outside of card");
+        return;
+    }
+    if (!bus || !*bus || !name || !*name) {
+        parser_fail(state, "volume needs a bus and a ctl");
+        return;
+    }
+    int db_min, db_step;
+    if (parse_int(find_attr(attrs, "db_min"), &db_min) != 0 ||
+        parse_int(find_attr(attrs, "db_step"), &db_step) != 0 || db_step <= 0) {
+        parser_fail(state, "volume needs db_min and a positive db_step");
+        return;
+    }
+    struct platform_ctl *ctls = realloc(state->ctls,
+                                        (state->num_ctls + 1) * sizeof(struct platform_ctl));
+    if (!ctls) {
+        parser_fail(state, "out of memory");
+        return;
+    }
+    state->ctls = ctls;
+    struct platform_ctl ctl = {
+        .card_index = state->current_card,
+        .name = strdup(name),
+        .bus = strdup(bus),
+        .db_min = db_min,
+        .db_step = db_step,
+    };
+    state->ctls[state->num_ctls++] = ctl;
+    state->num_volumes++;
+    if (!ctl.name || !ctl.bus) {
+        parser_fail(state, "out of memory");
+    }
+}
+
+static void parse_microphone(struct platform_parser *state, const XML_Char **attrs) {
+    const char *id = find_attr(attrs, "id");
+    const char *location = find_attr(attrs, "location");
+    const char *directionality = find_attr(attrs, "directionality");
+    if (!state->has_mics) {
+        state->mics.num_mics = 0;
+        state->has_mics = true;
+    }
+    if (state->mics.num_mics == MIC_ARRAY_MAX_MICS) {
+        parser_fail(state, "too many microphones");
+        return;
+    }
+    struct mic_array_mic *mic = &state->mics.mics[state->mics.num_mics];
+    const struct audio_microphone_coordinate unknown = {
+        AUDIO_MICROPHONE_COORDINATE_UNKNOWN,
+        AUDIO_MICROPHONE_COORDINATE_UNKNOWN,
+        AUDIO_MICROPHONE_COORDINATE_UNKNOWN,
+    };
+    memset(mic, 0, sizeof(*mic));
+    mic->channel = UINT32_MAX;
+    mic->position = unknown;
+    mic->orientation = unknown;
+    if (!id || !*id || strlen(id) >= sizeof(mic->id) ||
+        parse_uint_attr(attrs, "channel", &mic->channel) != 0 || mic->channel == UINT32_MAX ||
+        parse_coordinate_attrs(attrs, "", &mic->position) != 0 ||
+        parse_coordinate_attrs(attrs, "orientation_", &mic->orientation) != 0) {
+        parser_fail(state, "microphone needs an id, a channel and numeric coordinates");
+        return;
+    }
+    strcpy(mic->id, id);
+
+    mic->location = AUDIO_MICROPHONE_LOCATION_UNKNOWN;
+    for (unsigned int i = 0; location && i < sizeof(mic_locations) / sizeof(mic_locations[0]);
+         i++) {
+        if (strcmp(location, mic_locations[i].name) == 0) {
+            mic->location = mic_locations[i].value;
+        }
+    }
+    mic->directionality = AUDIO_MICROPHONE_DIRECTIONALITY_UNKNOWN;
+    for (unsigned int i = 0;
+         directionality && i < sizeof(mic_directionalities) / sizeof(mic_directionalities[0]);
+         i++) {
+        if (strcmp(directionality, mic_directionalities[i].name) == 0) {
+            mic->directionality = mic_directionalities[i].value;
+        }
+    }
+    state->mics.num_mics++;
+}
+
+static void parse_beam(struct platform_parser *state, const XML_Char **attrs) {
+    struct audio_microphone_coordinate target = {
+        AUDIO_MICROPHONE_COORDINATE_UNKNOWN,
+        AUDIO_MICROPHONE_COORDINATE_UNKNOWN,
+        AUDIO_MICROPHONE_COORDINATE_UNKNOWN,
+    };
+    if (parse_coordinate_attrs(attrs, "", &target) != 0 ||
+        target.x == AUDIO_MICROPHONE_COORDINATE_UNKNOWN ||
+        target.y == AUDIO_MICROPHONE_COORDINATE_UNKNOWN ||
+        target.z == AUDIO_MICROPHONE_COORDINATE_UNKNOWN) {
+        parser_fail(state, "beam needs x, y and z");
+        return;
+    }
+    state->mics.beam_target = target;
+    state->mics.has_beam = true;
+}
+
+static void start_tag(void *data, const XML_Char *tag, const XML_Char **attrs) {
+    struct platform_parser *state = data;
+    if (strcmp(tag, "pcm") == 0) {
+        parse_pcm(state, attrs);
+    } else if (strcmp(tag, "card") == 0) {
+        parse_card(state, attrs);
+    } else if (strcmp(tag, "ctl") == 0) {
+        parse_ctl(state, attrs);
+    } else if (strcmp(tag, "volume") == 0) {
+        parse_volume(state, attrs);
+    } else if (strcmp(tag, "microphone") == 0) {
+        parse_microphone(state, attrs);
+    } else if (strcmp(tag, "beam") == 0) {
+        parse_beam(state, attrs);
+    } else if (strcmp(tag, "audio_platform") != 0) {
+        ALOGW("%s: ignoring <%s>", __func__, tag);
+    }
+}
+
+static void end_tag(void *data, const XML_Char *tag) {
+    struct platform_parser *state = data;
+    if (strcmp(tag, "card") == 0) {
+        state->current_card = -1;
+    }
+}
+
+static char *copy_string(char **strings, const char *string) {
+    char *copy = strcpy(*strings, string);
+    *strings += strlen(string) + 1;
+    return copy;
+}
+
+// Lays the cards, their mixer defaults, bus volumes and the control names out
+// in a single block. Built in hardware routes are kept for cards that are
+// still there, as are their capture volumes and the built in bus volumes of
+// cards that list none.
+static int build_cards(struct platform_parser *state, struct audio_platform *platform) {
+    size_t strings_size = 0;
+    for (unsigned int i = 0; i < state->num_ctls; i++) {
+        strings_size += strlen(state->ctls[i].name) + 1;
+        if (state->ctls[i].strval) {
+            strings_size += strlen(state->ctls[i].strval) + 1;
+        }
+        if (state->ctls[i].bus) {
+            strings_size += strlen(state->ctls[i].bus) + 1;
+        }
+    }
+    const unsigned int num_defaults = state->num_ctls - state->num_volumes;
+    const size_t cards_size = (state->num_cards + 1) * sizeof(struct device_card);
+    const size_t ctls_size =
+            (num_defaults + state->num_cards) * sizeof(struct route_setting);
+    const size_t volumes_size =
+            (state->num_volumes + state->num_cards) * sizeof(struct bus_volume);
+    char *block = calloc(1, cards_size + ctls_size + volumes_size + strings_size);
+    if (!block) {
+        return -ENOMEM;
+    }
+
+    struct device_card *cards = (struct device_card *)block;
+    struct route_setting *route = (struct route_setting *)(block + cards_size);
+    struct bus_volume *volume = (struct bus_volume *)(block + cards_size + ctls_size);
+    char *strings = block + cards_size + ctls_size + volumes_size;
+    for (unsigned int card = 0; card < state->num_cards; card++) {
+        cards[card].card = state->card_ids[card];
+        cards[card].defaults = route;
+        for (struct device_card *builtin = platform->cards;
+             builtin && builtin->card != UINT32_MAX; builtin++) {
+            if (builtin->card == cards[card].card) {
+                cards[card].routes = builtin->routes;
+                cards[card].volumes = builtin->volumes;
+                cards[card].capture_volumes = builtin->capture_volumes;
+            }
+        }
+        struct bus_volume *card_volumes = volume;
+        for (unsigned int i = 0; i < state->num_ctls; i++) {
+            const struct platform_ctl *ctl = &state->ctls[i];
+            if (ctl->card_index != card) {
+                continue;
+            }
+            if (ctl->bus) {
+                volume->bus_address = copy_string(&strings, ctl->bus);
+                volume->ctl_name = copy_string(&strings, ctl->name);
+                volume->db_min = ctl->db_min;
+                volume->db_step = ctl->db_step;
+                volume++;
+                continue;
+            }
+            route->ctl_name = copy_string(&strings, ctl->name);
+            route->intval = ctl->intval;
+            if (ctl->strval) {
+                route->strval = copy_string(&strings, ctl->strval);
+            }
+            route++;
+        }
+        if (volume != card_volumes) {
+            cards[card].volumes = card_volumes;
+        }
+        // Left zeroed, these end the lists
+        route++;
+        volume++;
+    }
+    cards[state->num_cards].card = UINT32_MAX;
+
+    free(platform->loaded);
+    platform->loaded = block;
+    platform->cards = cards;
+    return 0;
+}
+
+static int parse_file(struct platform_parser *state, FILE *file) {
+    int eof = 0;
+    while (!eof && state->error == 0) {
+        void *buffer = XML_GetBuffer(state->parser, PLATFORM_READ_SIZE);
+        if (!buffer) {
+            return -ENOMEM;
+        }
+        const size_t bytes = fread(buffer, 1, PLATFORM_READ_SIZE, file);
+        if (ferror(file)) {
+            return -EIO;
+        }
+        eof = feof(file);
+        if (XML_ParseBuffer(state->parser, bytes, eof) == XML_STATUS_ERROR &&
+            state->error == 0) {
+            ALOGE("%s: line %lu: %s", __func__, XML_GetCurrentLineNumber(state->parser),
+                  XML_ErrorString(XML_GetErrorCode(state->parser)));
+            return -EINVAL;
+        }
+    }
+    return state->error;
+}
+
+int audio_platform_load(struct audio_platform *platform, const char *path) {
+    if (!platform->builtin) {
+        struct platform_builtin *builtin = calloc(1, sizeof(struct platform_builtin));
+        if (builtin) {
+            for (unsigned int i = 0; i < PLATFORM_PCM_COUNT; i++) {
+                const struct audio_platform_pcm *pcm = platform_pcm(platform, i);
+                builtin->pcm[i] = *pcm;
+                builtin->pcm_config[i] = *pcm->config;
+            }
+            builtin->mics = platform->mics;
+        } else {
+            ALOGW("%s: cannot save the built in platform", __func__);
+        }
+        platform->builtin = builtin;
+    }
+
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        ALOGV("%s: no %s, using the built in platform", __func__, path);
+        return -ENOENT;
+    }
+
+    struct platform_parser state = {
+        .current_card = -1,
+        .mics = platform->mics,
+    };
+    for (unsigned int i = 0; i < PLATFORM_PCM_COUNT; i++) {
+        const struct audio_platform_pcm *pcm = platform_pcm(platform, i);
+        state.pcm_card[i] = pcm->card;
+        state.pcm_device[i] = pcm->device;
+        state.pcm_config[i] = *pcm->config;
+    }
+
+    int ret = -ENOMEM;
+    state.parser = XML_ParserCreate(NULL);
+    if (state.parser) {
+        XML_SetUserData(state.parser, &state);
+        XML_SetElementHandler(state.parser, start_tag, end_tag);
+        ret = parse_file(&state, file);
+        XML_ParserFree(state.parser);
+    }
+    fclose(file);
+
+    if (ret == 0 && state.num_cards > 0) {
+        ret = build_cards(&state, platform);
+    }
+    if (ret == 0) {
+        for (unsigned int i = 0; i < PLATFORM_PCM_COUNT; i++) {
+            struct audio_platform_pcm *pcm = platform_pcm(platform, i);
+            pcm->card = state.pcm_card[i];
+            pcm->device = state.pcm_device[i];
+            *pcm->config = state.pcm_config[i];
+        }
+        platform->mics = state.mics;
+        ALOGI("%s: loaded %s, %u cards", __func__, path, state.num_cards);
+    } else {
+        ALOGE("%s: cannot load %s: %d, using the built in platform", __func__, path, ret);
+    }
+
+    for (unsigned int i = 0; i < state.num_ctls; i++) {
+        free(state.ctls[i].name);
+        free(state.ctls[i].strval);
+        free(state.ctls[i].bus);
+    }
+    free(state.ctls);
+    free(state.card_ids);
+    return ret;
+}
+
+void audio_platform_release(struct audio_platform *platform, struct device_card *builtin_cards) {
+    free(platform->loaded);
+    platform->loaded = NULL;
+    platform->cards = builtin_cards;
+
+    struct platform_builtin *builtin = platform->builtin;
+    if (builtin) {
+        for (unsigned int i = 0; i < PLATFORM_PCM_COUNT; i++) {
+            struct audio_platform_pcm *pcm = platform_pcm(platform, i);
+            *pcm = builtin->pcm[i];
+            *pcm->config = builtin->pcm_config[i];
+        }
+        platform->mics = builtin->mics;
+        free(builtin);
+        platform->builtin = NULL;
+    }
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2019 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AUDIO_PLATFORM_H
+#define AUDIO_PLATFORM_H
+
+#include <tinyalsa/asoundlib.h>
+
+#include "mic_array.h"
+#include "platform/audio_hal_types.h"
+
+// PCM the HAL opens for one kind of stream. card or device is UINT32_MAX if
+// the board has none.
+struct audio_platform_pcm {
+    unsigned int card;
+    unsigned int device;
+    struct pcm_config *config;
+};
+
+// Board description. The compile-time platform_dependencies.h fills it in and
+// a platform file loaded at device open may override any part of it.
+struct audio_platform {
+    struct audio_platform_pcm out_default;
+    struct audio_platform_pcm out_hfp;
+    struct audio_platform_pcm out_fast;
+    struct audio_platform_pcm out_mmap;
+    struct audio_platform_pcm in_default;
+    struct audio_platform_pcm in_fm;
+    struct audio_platform_pcm in_aux;
+    struct audio_platform_pcm in_hfp;
+    struct audio_platform_pcm in_mmap;
+
+    struct device_card *cards;      // Ends with card UINT32_MAX
+    struct mic_array mics;          // Microphones of in_default
+    void *loaded;                   // Storage of the loaded cards, NULL if built in
+    void *builtin;                  // Saved by audio_platform_load(), see audio_platform_release()
+};
+
+// Applies the platform file at path on top of platform, e.g.
+//
+//     <audio_platform>
+//         <pcm name="out_default" card="0" device="0" channels="8" rate="48000"
+//              period_size="1024" period_count="4"/>
+//         <card id="0">
+//             <ctl name="DAC1 Playback Volume" value="160"/>
+//             <ctl name="DAC Volume Control Type" enum="Master + Individual"/>
+//             <volume bus="bus1_navigation_out" ctl="DAC2 Playback Volume"
+//                     db_min="-10050" db_step="50"/>
+//         </card>
+//         <microphone id="mic_front_left" channel="0" x="0.35" y="0.9" z="1.2"
+//                     location="mainbody" directionality="omni"/>
+//         <beam x="0.35" y="0.4" z="1.1"/>
+//     </audio_platform>
+//
+// A <card> list replaces the built in cards and their mixer defaults. A
+// <volume> gives a bus that has outputs of its own a codec volume control,
+// whose lowest value is db_min and each value db_step above, in millibels,
+// see platform/kingfisher/audio_platform_info.xml.
+// A <microphone> list, in meters in the Android device frame with optional
+// orientation_x/y/z, replaces the built in microphones of in_default. <beam>
+// steers a beamformer at a point, see struct mic_array.
+// Hardware routes and capture volumes are only built in. Returns -ENOENT if
+// there is no file, in which case platform is left as is, or -EINVAL if the
+// file is malformed.
+int audio_platform_load(struct audio_platform *platform, const char *path);
+// Frees what audio_platform_load() allocated and puts back builtin_cards. The
+// PCMs, their pcm_config and the microphones return to what they were before
+// audio_platform_load(), including changes the HAL made in between, so the
+// next device open starts from the built in description again.
+void audio_platform_release(struct audio_platform *platform, struct device_card *builtin_cards);
+
+#endif  // AUDIO_PLATFORM_H
@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2019 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AUDIO_SEQLOCK_H
+#define AUDIO_SEQLOCK_H
+
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+// Sequence lock for small records published by one writer at a time and read
+// without blocking it. Writers must be serialized by the caller. Fields of the
+// record are accessed with relaxed atomics:
+//
+//     do {
+//         seq = audio_seqlock_read_begin(&lock);
+//         value = atomic_load_explicit(&field, memory_order_relaxed);
+//     } while (audio_seqlock_read_retry(&lock, seq));
+typedef struct audio_seqlock {
+    atomic_uint seq;  // Odd while a write is in progress
+} audio_seqlock_t;
+
+static inline void audio_seqlock_write_begin(audio_seqlock_t *seqlock) {
+    unsigned int seq = atomic_load_explicit(&seqlock->seq, memory_order_relaxed);
+    atomic_store_explicit(&seqlock->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static inline void audio_seqlock_write_end(audio_seqlock_t *seqlock) {
+    unsigned int seq = atomic_load_explicit(&seqlock->seq, memory_order_relaxed);
+    atomic_store_explicit(&seqlock->seq, seq + 1, memory_order_release);
+}
+
+static inline unsigned int audio_seqlock_read_begin(audio_seqlock_t *seqlock) {
+    unsigned int seq;
+    while ((seq = atomic_load_explicit(&seqlock->seq, memory_order_acquire)) & 1) {
+        sched_yield();
+    }
+    return seq;
+}
+
+static inline bool audio_seqlock_read_retry(audio_seqlock_t *seqlock, unsigned int seq) {
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&seqlock->seq, memory_order_relaxed) != seq;
+}
+
+#endif  // AUDIO_SEQLOCK_H
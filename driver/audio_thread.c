@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2019 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_generic"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <log/log.h>
+
+#include "audio_thread.h"
+
+// Used when an RT policy is refused, matches ANDROID_PRIORITY_URGENT_AUDIO
+#define AUDIO_THREAD_FALLBACK_NICE (-19)
+
+// pthread_setname_np() limit including the terminating zero
+#define AUDIO_THREAD_NAME_LEN 16
+
+struct audio_thread_start {
+    struct audio_thread_config config;
+    char name[AUDIO_THREAD_NAME_LEN];
+    void *(*routine)(void *);
+    void *arg;
+};
+
+static void audio_thread_apply_config(const struct audio_thread_start *start) {
+    pthread_setname_np(pthread_self(), start->name);
+
+    if (start->config.cpu_mask != 0) {
+        cpu_set_t cpu_set;
+        CPU_ZERO(&cpu_set);
+        for (int cpu = 0; cpu < 32; cpu++) {
+            if (start->config.cpu_mask & (1u << cpu)) {
+                CPU_SET(cpu, &cpu_set);
+            }
+        }
+        if (sched_setaffinity(0, sizeof(cpu_set), &cpu_set) != 0) {
+            ALOGW("%s: %s: cannot set affinity 0x%x: %s", __func__, start->name,
+                  start->config.cpu_mask, strerror(errno));
+        }
+    }
+
+    if (start->config.policy == SCHED_FIFO || start->config.policy == SCHED_RR) {
+        struct sched_param param = { .sched_priority = start->config.priority };
+        if (sched_setscheduler(0, start->config.policy, &param) == 0) {
+            return;
+        }
+        ALOGW("%s: %s: cannot set RT policy %d priority %d: %s, using nice %d", __func__,
+              start->name, start->config.policy, start->config.priority, strerror(errno),
+              AUDIO_THREAD_FALLBACK_NICE);
+        setpriority(PRIO_PROCESS, gettid(), AUDIO_THREAD_FALLBACK_NICE);
+    } else {
+        setpriority(PRIO_PROCESS, gettid(), start->config.priority);
+    }
+}
+
+static void *audio_thread_trampoline(void *context) {
+    struct audio_thread_start start = *(struct audio_thread_start *)context;
+    free(context);
+
+    audio_thread_apply_config(&start);
+    return start.routine(start.arg);
+}
+
+int audio_thread_create(pthread_t *thread, const struct audio_thread_config *config,
+                        const char *name_suffix, void *(*routine)(void *), void *arg) {
+    struct audio_thread_start *start = calloc(1, sizeof(struct audio_thread_start));
+    if (!start) {
+        return -ENOMEM;
+    }
+    start->config = *config;
+    start->routine = routine;
+    start->arg = arg;
+    if (name_suffix && name_suffix[0] != '\0') {
+        snprintf(start->name, sizeof(start->name), "%s.%s", config->name_prefix, name_suffix);
+    } else {
+        snprintf(start->name, sizeof(start->name), "%s", config->name_prefix);
+    }
+
+    int ret = pthread_create(thread, (const pthread_attr_t *) NULL,
+                             audio_thread_trampoline, start);
+    if (ret != 0) {
+        ALOGE("%s: cannot create %s: %s", __func__, start->name, strerror(ret));
+        free(start);
+        return -ret;
+    }
+    return 0;
+}
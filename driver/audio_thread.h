@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2019 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AUDIO_THREAD_H
+#define AUDIO_THREAD_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+
+struct audio_thread_config {
+    const char *name_prefix;  // Thread name is "<name_prefix>.<suffix>", cut to 15 chars
+    int policy;               // SCHED_FIFO, SCHED_RR or SCHED_OTHER
+    int priority;             // sched_priority for RT policies, nice value for SCHED_OTHER
+    uint32_t cpu_mask;        // Allowed CPUs, 0 keeps the inherited affinity
+};
+
+// Creates a worker thread that applies its name, CPU affinity and scheduling
+// policy before running routine. If the RT policy is refused (no CAP_SYS_NICE or
+// RLIMIT_RTPRIO) the thread runs at an urgent audio nice level instead.
+int audio_thread_create(pthread_t *thread, const struct audio_thread_config *config,
+                        const char *name_suffix, void *(*routine)(void *), void *arg);
+
+#endif  // AUDIO_THREAD_H
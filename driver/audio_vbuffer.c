@@ -103,6 +103,18 @@ int audio_vbuffer_dead(audio_vbuffer_t *audio_vbuffer) {
   return dead;
 }
 
+int audio_vbuffer_flush(audio_vbuffer_t *audio_vbuffer) {
+  if (!audio_vbuffer) {
+    return -EINVAL;
+  }
+  pthread_mutex_lock(&audio_vbuffer->lock);
+  audio_vbuffer->head = 0;
+  audio_vbuffer->tail = 0;
+  audio_vbuffer->live = 0;
+  pthread_mutex_unlock(&audio_vbuffer->lock);
+  return 0;
+}
+
 size_t audio_vbuffer_write(audio_vbuffer_t *audio_vbuffer, const void *buffer,
                            size_t frame_count) {
   size_t frames_written = 0;
@@ -45,6 +45,9 @@ int audio_vbuffer_live(audio_vbuffer_t *audio_vbuffer);
 // Get the number of dead (read) frames in vbuffer
 int audio_vbuffer_dead(audio_vbuffer_t *audio_vbuffer);
 
+// Drop all live frames
+int audio_vbuffer_flush(audio_vbuffer_t *audio_vbuffer);
+
 // Write to vbuffer
 // NOTE: this function assumes input buffer has the same format as vbuffer
 size_t audio_vbuffer_write(audio_vbuffer_t *audio_vbuffer, const void *buffer,
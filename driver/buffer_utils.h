@@ -21,6 +21,10 @@
 #include <stdlib.h>
 #include <assert.h>
 
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 inline void audio_buffer_shrink(void *out_buffer, const size_t out_channels,
                                 const void *in_buffer, const size_t in_channels,
                                 const size_t frame_count, const size_t format_bytes)
@@ -74,4 +78,44 @@ inline void audio_buffer_adjust(void *out_buffer, const size_t out_channels,
     }
 }
 
+// Scales each channel of 16 bit frames by its own Q15 gain, saturating.
+// Gains must be below 2 << 15 so that a product fits in 32 bit.
+static inline void audio_buffer_apply_channel_gain(int16_t *buffer, const size_t channels,
+                                                   const size_t frame_count,
+                                                   const int32_t *gain_q15)
+{
+    size_t frame = 0;
+#if defined(__ARM_NEON)
+    // Eight frames take exactly channels vectors of eight samples, so the
+    // gains of those eight frames line up with the vectors the same way
+    // every time
+    if (channels <= 8) {
+        int32_t gains[8 * 8];
+        for (size_t i = 0; i < 8 * channels; i++) {
+            gains[i] = gain_q15[i % channels];
+        }
+        for (; frame + 8 <= frame_count; frame += 8) {
+            int16_t *samples = buffer + frame * channels;
+            for (size_t v = 0; v < channels; v++) {
+                const int16x8_t in = vld1q_s16(samples + v * 8);
+                int32x4_t low = vmulq_s32(vmovl_s16(vget_low_s16(in)), vld1q_s32(gains + v * 8));
+                int32x4_t high = vmulq_s32(vmovl_s16(vget_high_s16(in)),
+                                           vld1q_s32(gains + v * 8 + 4));
+                low = vshrq_n_s32(low, 15);
+                high = vshrq_n_s32(high, 15);
+                vst1q_s16(samples + v * 8, vcombine_s16(vqmovn_s32(low), vqmovn_s32(high)));
+            }
+        }
+    }
+#endif
+    for (; frame < frame_count; frame++) {
+        int16_t *samples = buffer + frame * channels;
+        for (size_t ch = 0; ch < channels; ch++) {
+            const int32_t scaled = (samples[ch] * gain_q15[ch]) >> 15;
+            samples[ch] = scaled > INT16_MAX ? INT16_MAX :
+                          scaled < INT16_MIN ? INT16_MIN : (int16_t)scaled;
+        }
+    }
+}
+
 #endif
\ No newline at end of file
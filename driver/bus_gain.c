@@ -0,0 +1,220 @@
+/*
+ * Copyright (C) 2019 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_generic"
+
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <expat.h>
+#include <log/log.h>
+
+#include "bus_gain.h"
+
+#define POLICY_READ_SIZE 4096
+
+int bus_gain_init(struct bus_gain *gain, const char *bus_address,
+                  const struct audio_gain *stage) {
+    memset(gain, 0, sizeof(*gain));
+    if (stage->step_value == 0 || stage->max_value <= stage->min_value) {
+        return -EINVAL;
+    }
+    gain->stage = *stage;
+    gain->num_steps = (stage->max_value - stage->min_value) / (int)stage->step_value + 1;
+    gain->amplitude = calloc(gain->num_steps, sizeof(float));
+    gain->q15 = calloc(gain->num_steps, sizeof(int32_t));
+    gain->bus_address = bus_address ? strdup(bus_address) : NULL;
+    if (!gain->amplitude || !gain->q15 || (bus_address && !gain->bus_address)) {
+        bus_gain_release(gain);
+        return -ENOMEM;
+    }
+
+    const float min_db = (float)stage->min_value / 100.;
+    const float max_db = (float)stage->max_value / 100.;
+    const unsigned int total_steps = gain->num_steps - 1;
+    for (unsigned int step = 0; step < gain->num_steps; step++) {
+        // curve: 10^((minDb + (maxDb - minDb) * step / totalSteps) / 20)
+        // the gain at step 0 is subtracted so that the lowest volume control
+        // position fully silences playback
+        gain->amplitude[step] =
+                pow(10, (min_db + (max_db - min_db) * (step / (float)total_steps)) / 20) -
+                pow(10, min_db / 20);
+        const float q15 = gain->amplitude[step] * GAIN_Q15_UNITY;
+        // Keeps sample * gain within int32
+        gain->q15[step] = q15 < 0 ? 0 :
+                q15 >= 2 * GAIN_Q15_UNITY ? 2 * GAIN_Q15_UNITY - 1 : (int32_t)q15;
+    }
+    return 0;
+}
+
+void bus_gain_release(struct bus_gain *gain) {
+    free(gain->bus_address);
+    free(gain->amplitude);
+    free(gain->q15);
+    memset(gain, 0, sizeof(*gain));
+}
+
+struct policy_parser {
+    XML_Parser parser;
+    bool in_primary;            // Inside <module name="primary">
+    char *port_address;         // Bus device port being parsed, NULL otherwise
+    bool port_has_gain;
+    struct bus_gain *gains;
+    unsigned int num_gains;
+};
+
+static const char *find_attr(const XML_Char **attrs, const char *name) {
+    for (unsigned int i = 0; attrs[i]; i += 2) {
+        if (strcmp(attrs[i], name) == 0) {
+            return attrs[i + 1];
+        }
+    }
+    return NULL;
+}
+
+static bool parse_int_attr(const XML_Char **attrs, const char *name, int *result) {
+    const char *value = find_attr(attrs, name);
+    char *end;
+    if (!value || !*value) {
+        return false;
+    }
+    *result = strtol(value, &end, 10);
+    return *end == '\0';
+}
+
+// Only the first, joint, gain of a port is used as its volume
+static void parse_gain(struct policy_parser *state, const XML_Char **attrs) {
+    struct audio_gain stage = {};
+    int step_value;
+    state->port_has_gain = true;
+    if (!parse_int_attr(attrs, "minValueMB", &stage.min_value) ||
+        !parse_int_attr(attrs, "maxValueMB", &stage.max_value) ||
+        !parse_int_attr(attrs, "stepValueMB", &step_value) || step_value <= 0) {
+        ALOGW("%s: line %lu: bad gain of %s", __func__,
+              XML_GetCurrentLineNumber(state->parser), state->port_address);
+        return;
+    }
+    stage.step_value = step_value;
+    parse_int_attr(attrs, "defaultValueMB", &stage.default_value);
+
+    struct bus_gain *gains = realloc(state->gains,
+                                     (state->num_gains + 2) * sizeof(struct bus_gain));
+    if (!gains) {
+        return;
+    }
+    state->gains = gains;
+    if (bus_gain_init(&state->gains[state->num_gains], state->port_address, &stage) == 0) {
+        state->num_gains++;
+    }
+}
+
+static void start_tag(void *data, const XML_Char *tag, const XML_Char **attrs) {
+    struct policy_parser *state = data;
+    if (strcmp(tag, "module") == 0) {
+        const char *name = find_attr(attrs, "name");
+        state->in_primary = name && strcmp(name, "primary") == 0;
+    } else if (state->in_primary && strcmp(tag, "devicePort") == 0) {
+        const char *type = find_attr(attrs, "type");
+        const char *address = find_attr(attrs, "address");
+        if (type && strcmp(type, "AUDIO_DEVICE_OUT_BUS") == 0 && address) {
+            state->port_address = strdup(address);
+            state->port_has_gain = false;
+        }
+    } else if (state->port_address && !state->port_has_gain && strcmp(tag, "gain") == 0) {
+        parse_gain(state, attrs);
+    }
+}
+
+static void end_tag(void *data, const XML_Char *tag) {
+    struct policy_parser *state = data;
+    if (strcmp(tag, "module") == 0) {
+        state->in_primary = false;
+    } else if (strcmp(tag, "devicePort") == 0) {
+        free(state->port_address);
+        state->port_address = NULL;
+    }
+}
+
+struct bus_gain *bus_gains_load(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        ALOGW("%s: cannot open %s, bus gains use the default stage", __func__, path);
+        return NULL;
+    }
+
+    struct policy_parser state = {};
+    state.parser = XML_ParserCreate(NULL);
+    if (!state.parser) {
+        fclose(file);
+        return NULL;
+    }
+    XML_SetUserData(state.parser, &state);
+    XML_SetElementHandler(state.parser, start_tag, end_tag);
+
+    bool ok = true;
+    int eof = 0;
+    while (ok && !eof) {
+        void *buffer = XML_GetBuffer(state.parser, POLICY_READ_SIZE);
+        if (!buffer) {
+            ok = false;
+            break;
+        }
+        const size_t bytes = fread(buffer, 1, POLICY_READ_SIZE, file);
+        eof = feof(file) || ferror(file);
+        if (XML_ParseBuffer(state.parser, bytes, eof) == XML_STATUS_ERROR) {
+            ALOGE("%s: %s line %lu: %s", __func__, path,
+                  XML_GetCurrentLineNumber(state.parser),
+                  XML_ErrorString(XML_GetErrorCode(state.parser)));
+            ok = false;
+        }
+    }
+    XML_ParserFree(state.parser);
+    fclose(file);
+    free(state.port_address);
+
+    if (!ok || state.num_gains == 0) {
+        if (state.gains) {
+            state.gains[state.num_gains].bus_address = NULL;
+            bus_gains_release(state.gains);
+        }
+        return NULL;
+    }
+    // parse_gain() always leaves room for the end of the table
+    memset(&state.gains[state.num_gains], 0, sizeof(struct bus_gain));
+    ALOGI("%s: %u bus gain stages from %s", __func__, state.num_gains, path);
+    return state.gains;
+}
+
+void bus_gains_release(struct bus_gain *gains) {
+    for (struct bus_gain *gain = gains; gain && gain->bus_address; gain++) {
+        bus_gain_release(gain);
+    }
+    free(gains);
+}
+
+const struct bus_gain *bus_gains_find(const struct bus_gain *gains, const char *bus_address,
+                                      const struct bus_gain *fallback) {
+    for (const struct bus_gain *gain = gains; gain && gain->bus_address; gain++) {
+        if (strcmp(gain->bus_address, bus_address) == 0) {
+            return gain;
+        }
+    }
+    return fallback;
+}
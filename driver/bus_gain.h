@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2019 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BUS_GAIN_H
+#define BUS_GAIN_H
+
+#include <stdint.h>
+
+#include <system/audio.h>
+
+#define GAIN_Q15_UNITY (1 << 15)
+
+// Gain stage of a bus with the gain of every step worked out up front, so a
+// gain change is a table lookup and the mix path stays in fixed point
+struct bus_gain {
+    char *bus_address;          // NULL ends a table
+    struct audio_gain stage;    // Values in millibels
+    unsigned int num_steps;
+    float *amplitude;           // Amplitude ratio of each step
+    int32_t *q15;               // Same in Q15, below 2 * GAIN_Q15_UNITY
+};
+
+// Fills in the tables of gain for stage. Returns -EINVAL for an unusable
+// stage and -ENOMEM.
+int bus_gain_init(struct bus_gain *gain, const char *bus_address,
+                  const struct audio_gain *stage);
+void bus_gain_release(struct bus_gain *gain);
+
+// Step of a gain value in millibels, clamped to the stage
+static inline unsigned int bus_gain_step(const struct bus_gain *gain, int value) {
+    const int step = (value - gain->stage.min_value) / (int)gain->stage.step_value;
+    return step < 0 ? 0 : step >= (int)gain->num_steps ? gain->num_steps - 1 : step;
+}
+
+// Reads the gain stages of the bus device ports of the primary module from an
+// audio policy configuration file. Returns a table ending with a NULL
+// bus_address, or NULL if the file has none or cannot be read.
+struct bus_gain *bus_gains_load(const char *path);
+void bus_gains_release(struct bus_gain *gains);
+// Gain of bus_address in gains, or fallback if it has none
+const struct bus_gain *bus_gains_find(const struct bus_gain *gains, const char *bus_address,
+                                      const struct bus_gain *fallback);
+
+#endif  // BUS_GAIN_H
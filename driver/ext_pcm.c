@@ -17,239 +17,471 @@
 #define LOG_TAG "audio_hw_generic"
 
 #include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include <log/log.h>
-#include <cutils/str_parms.h>
 
 #include "ext_pcm.h"
 
+// Quanta kept queued in the PCM while a low-latency source is active
+#define LOW_LATENCY_QUEUED_QUANTA 2
+
+// Longest wait between attempts at a PCM that cannot be opened or written
+#define ENGINE_RETRY_MAX_MS 1000
+
 static pthread_mutex_t ext_pcm_init_lock = PTHREAD_MUTEX_INITIALIZER;
-static struct ext_pcm *shared_ext_pcm = NULL;
-#define MAX(a, b) (((a) > (b)) ? (a) : (b))
-#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+static struct ext_pcm *ext_pcm_list = NULL;  // Protected by ext_pcm_init_lock
 
-/* copied from libcutils/str_parms.c */
-static bool str_eq(void *key_a, void *key_b) {
-  return !strcmp((const char *)key_a, (const char *)key_b);
+static inline int16_t clamp16(int32_t sample) {
+  if (sample > INT16_MAX) return INT16_MAX;
+  if (sample < INT16_MIN) return INT16_MIN;
+  return (int16_t)sample;
 }
 
-/**
- * use djb hash unless we find it inadequate.
- * copied from libcutils/str_parms.c
- */
-#ifdef __clang__
-__attribute__((no_sanitize("integer")))
-#endif
-static int str_hash_fn(void *str) {
-  uint32_t hash = 5381;
-  char *p;
-  for (p = str; p && *p; p++) {
-    hash = ((hash << 5) + hash) + *p;
-  }
-  return (int)hash;
+static void engine_publish_position(struct ext_pcm *ext_pcm, unsigned int queued,
+                                    const struct timespec *timestamp) {
+  audio_seqlock_write_begin(&ext_pcm->position_lock);
+  atomic_store_explicit(&ext_pcm->position_written, ext_pcm->written, memory_order_relaxed);
+  atomic_store_explicit(&ext_pcm->position_queued, queued, memory_order_relaxed);
+  atomic_store_explicit(&ext_pcm->position_time_ns,
+                        timestamp->tv_sec * 1000000000LL + timestamp->tv_nsec,
+                        memory_order_relaxed);
+  audio_seqlock_write_end(&ext_pcm->position_lock);
 }
 
-static bool check_mixer_buffers(__unused void *key, void *value, void *context) {
-  struct ext_mixer_pipeline *pipeline = (struct ext_mixer_pipeline *)value;
-  int *counter = (int *)context;
+static void engine_close_pcm(struct ext_pcm *ext_pcm) {
+  if (ext_pcm->pcm) {
+    pcm_close(ext_pcm->pcm);
+    ext_pcm->pcm = NULL;
 
-  if (pipeline->position > 0) {
-    ++(*counter);
+    // Whatever was queued has been played or is lost
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    engine_publish_position(ext_pcm, 0, &now);
   }
-  return true;
 }
 
-static bool mixer_thread_mix(__unused void *key, void *value, void *context) {
-  struct ext_mixer_pipeline *pipeline_out = (struct ext_mixer_pipeline *)context;
-  struct ext_mixer_pipeline *pipeline_in = (struct ext_mixer_pipeline *)value;
-  pipeline_out->position = MAX(pipeline_out->position, pipeline_in->position);
-  for (int i = 0; i < pipeline_out->position; i++) {
-    float mixed = pipeline_out->buffer[i] + pipeline_in->buffer[i];
-    if (mixed > INT16_MAX) pipeline_out->buffer[i] = INT16_MAX;
-    else if (mixed < INT16_MIN) pipeline_out->buffer[i] = INT16_MIN;
-    else pipeline_out->buffer[i] = (int16_t)mixed;
+static int engine_open_pcm(struct ext_pcm *ext_pcm) {
+  ext_pcm->pcm = pcm_open(ext_pcm->card, ext_pcm->device, ext_pcm->flags, &ext_pcm->config);
+  if (!pcm_is_ready(ext_pcm->pcm)) {
+    ALOGE("%s: pcm_open(%u, %u) failed: %s", __func__, ext_pcm->card, ext_pcm->device,
+          pcm_get_error(ext_pcm->pcm));
+    engine_close_pcm(ext_pcm);
+    return -ENODEV;
   }
-  memset(pipeline_in, 0, sizeof(struct ext_mixer_pipeline));
-  return true;
+  return 0;
 }
 
-static void *mixer_thread_loop(void *context) {
-  ALOGD("%s: __enter__", __func__);
-  struct ext_pcm *ext_pcm = (struct ext_pcm *)context;
-
-  pthread_mutex_lock(&ext_pcm->mixer_lock);
-  do {
-    ext_pcm->mixer_pipeline.position = 0;
-    // Combine the output from every pipeline into one output buffer
-    hashmapForEach(ext_pcm->mixer_pipeline_map, mixer_thread_mix,
-        &ext_pcm->mixer_pipeline);
-    if (ext_pcm->mixer_pipeline.position > 0) {
-      pcm_write(ext_pcm->pcm, (void *)ext_pcm->mixer_pipeline.buffer,
-          ext_pcm->mixer_pipeline.position * sizeof(int16_t));
+// Pulls frame_count frames from every source. Returns the largest number of
+// frames any source provided; *active is set if at least one source is not in
+// standby. Updates the quantum for the next cycle.
+static int engine_mix(struct ext_pcm *ext_pcm, unsigned int frame_count, bool *active) {
+  unsigned int quantum = 0;
+  int mixed = 0;
+
+  memset(ext_pcm->mix_buffer, 0,
+         frame_count * ext_pcm->config.channels * sizeof(ext_pcm->mix_buffer[0]));
+  *active = false;
+
+  pthread_mutex_lock(&ext_pcm->sources_lock);
+  for (unsigned int i = 0; i < ext_pcm->source_count; i++) {
+    const struct ext_pcm_source *source = &ext_pcm->sources[i];
+    int frames = source->pull(source->cookie, ext_pcm->mix_buffer, frame_count,
+                              ext_pcm->written);
+    if (frames >= 0) {
+      *active = true;
+      if (frames > mixed) mixed = frames;
+      if (source->quantum && (quantum == 0 || source->quantum < quantum)) {
+        quantum = source->quantum;
+      }
     }
-    memset(&ext_pcm->mixer_pipeline, 0, sizeof(struct ext_mixer_pipeline));
-    // will unlock and lock automatically
-    pthread_cond_wait(&ext_pcm->mixer_wake, &ext_pcm->mixer_lock);
-  } while (!ext_pcm->mixer_exit_flag);
-  pthread_mutex_unlock(&ext_pcm->mixer_lock);
-  return NULL;
+  }
+  pthread_mutex_unlock(&ext_pcm->sources_lock);
+
+  ext_pcm->quantum = quantum < ext_pcm->config.period_size ? quantum : 0;
+  return mixed;
 }
-static int mixer_pipeline_write(struct ext_pcm *ext_pcm, const char *bus_address,
-                                const void *data, unsigned int count) {
-  pthread_mutex_lock(&ext_pcm->mixer_lock);
-  struct ext_mixer_pipeline *pipeline = hashmapGet(
-      ext_pcm->mixer_pipeline_map, bus_address);
-  if (!pipeline) {
-    pipeline = calloc(1, sizeof(struct ext_mixer_pipeline));
-    hashmapPut(ext_pcm->mixer_pipeline_map, bus_address, pipeline);
+
+// Sleeps until no more than LOW_LATENCY_QUEUED_QUANTA are left in the PCM.
+// pcm_write() alone would block only once the whole buffer is full.
+static void engine_throttle(struct ext_pcm *ext_pcm) {
+  unsigned int avail;
+  struct timespec tstamp;
+
+  if (!ext_pcm->pcm || pcm_get_htimestamp(ext_pcm->pcm, &avail, &tstamp) != 0) {
+    return;  // Not running yet
   }
-  unsigned int byteCount = MIN(count,
-      (MIXER_BUFFER_SIZE - pipeline->position) * sizeof(int16_t));
-  unsigned int int16Count = byteCount / sizeof(int16_t);
-  if (int16Count > 0) {
-    memcpy(&pipeline->buffer[pipeline->position], data, byteCount);
-    pipeline->position += int16Count;
+
+  const unsigned int buffer_size = pcm_get_buffer_size(ext_pcm->pcm);
+  const unsigned int queued = buffer_size > avail ? buffer_size - avail : 0;
+  const unsigned int target = ext_pcm->quantum * LOW_LATENCY_QUEUED_QUANTA;
+  if (queued > target) {
+    usleep(((uint64_t)(queued - target) * 1000000) / ext_pcm->config.rate);
   }
-  pthread_mutex_unlock(&ext_pcm->mixer_lock);
+}
 
-  int filled_buffers = 0;
-  hashmapForEach(ext_pcm->mixer_pipeline_map, check_mixer_buffers,
-        &filled_buffers);
+// Applies the final mix gain while converting to 16 bit. A gain change is
+// ramped linearly over the frames of this write.
+static void engine_convert(struct ext_pcm *ext_pcm, unsigned int frames) {
+  const unsigned int channels = ext_pcm->config.channels;
+  const int32_t target = atomic_load_explicit(&ext_pcm->gain_q15, memory_order_relaxed);
+  const int32_t start = ext_pcm->pcm ? ext_pcm->applied_gain_q15 : target;
+  ext_pcm->applied_gain_q15 = target;
+
+  if (start == target && target == EXT_PCM_GAIN_UNITY) {
+    for (unsigned int i = 0; i < frames * channels; i++) {
+      ext_pcm->write_buffer[i] = clamp16(ext_pcm->mix_buffer[i]);
+    }
+    return;
+  }
+  for (unsigned int frame = 0; frame < frames; frame++) {
+    const int64_t gain = start + ((int64_t)(target - start) * frame) / frames;
+    for (unsigned int channel = 0; channel < channels; channel++) {
+      const unsigned int i = frame * channels + channel;
+      const int64_t sample = (ext_pcm->mix_buffer[i] * gain) >> 15;
+      ext_pcm->write_buffer[i] = sample > INT16_MAX ? INT16_MAX :
+                                 sample < INT16_MIN ? INT16_MIN : (int16_t)sample;
+    }
+  }
+}
 
-  if (filled_buffers == ext_pcm->ref_count) {
-    pthread_cond_signal(&ext_pcm->mixer_wake);
+// Waits before the PCM is tried again, one period at first and twice as long
+// after every further failure, up to ENGINE_RETRY_MAX_MS. Only an exit cuts
+// the wait short.
+static void engine_back_off(struct ext_pcm *ext_pcm, unsigned int *retry_ms) {
+  const unsigned int period_ms =
+      ((uint64_t)ext_pcm->config.period_size * 1000) / ext_pcm->config.rate;
+  *retry_ms = *retry_ms ? *retry_ms * 2 : (period_ms ? period_ms : 1);
+  if (*retry_ms > ENGINE_RETRY_MAX_MS) {
+    *retry_ms = ENGINE_RETRY_MAX_MS;
   }
-  return 0;
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_nsec += *retry_ms * 1000000LL;
+  deadline.tv_sec += deadline.tv_nsec / 1000000000LL;
+  deadline.tv_nsec %= 1000000000LL;
+
+  pthread_mutex_lock(&ext_pcm->lock);
+  while (!ext_pcm->engine_exit) {
+    if (pthread_cond_timedwait(&ext_pcm->engine_wake, &ext_pcm->lock, &deadline) == ETIMEDOUT) {
+      break;
+    }
+  }
+  pthread_mutex_unlock(&ext_pcm->lock);
 }
 
-struct ext_pcm *ext_pcm_open_default(unsigned int card, unsigned int device,
-                             unsigned int flags, struct pcm_config *config) {
-  pthread_mutex_lock(&ext_pcm_init_lock);
-  if (shared_ext_pcm == NULL) {
-    shared_ext_pcm = calloc(1, sizeof(struct ext_pcm));
-    pthread_mutex_init(&shared_ext_pcm->lock, (const pthread_mutexattr_t *) NULL);
-    shared_ext_pcm->pcm = pcm_open(card, device, flags, config);
-    pthread_mutex_init(&shared_ext_pcm->mixer_lock, (const pthread_mutexattr_t *)NULL);
-    pthread_cond_init(&shared_ext_pcm->mixer_wake, NULL);
-    pthread_create(&shared_ext_pcm->mixer_thread, (const pthread_attr_t *)NULL,
-            mixer_thread_loop, shared_ext_pcm);
-    shared_ext_pcm->mixer_pipeline_map = hashmapCreate(8, str_hash_fn, str_eq);
-    shared_ext_pcm->ref_count = 0;
+// Returns -EIO if the frames were lost, the PCM is closed then
+static int engine_write(struct ext_pcm *ext_pcm, unsigned int frames) {
+  engine_convert(ext_pcm, frames);
+
+  // Lost frames count as written, the sources have consumed them
+  ext_pcm->written += frames;
+  if (pcm_write(ext_pcm->pcm, ext_pcm->write_buffer,
+                pcm_frames_to_bytes(ext_pcm->pcm, frames)) != 0) {
+    ALOGE("%s: pcm_write(%u, %u) failed: %s", __func__, ext_pcm->card, ext_pcm->device,
+          pcm_get_error(ext_pcm->pcm));
+    engine_close_pcm(ext_pcm);
+    return -EIO;
   }
-  pthread_mutex_unlock(&ext_pcm_init_lock);
 
-  pthread_mutex_lock(&shared_ext_pcm->lock);
-  shared_ext_pcm->ref_count += 1;
-  shared_ext_pcm->mixer_exit_flag = false;
-  pthread_mutex_unlock(&shared_ext_pcm->lock);
+  unsigned int avail;
+  struct timespec tstamp;
+  if (pcm_get_htimestamp(ext_pcm->pcm, &avail, &tstamp) != 0) {
+    return 0;
+  }
+  const unsigned int buffer_size = pcm_get_buffer_size(ext_pcm->pcm);
+  if (!(ext_pcm->flags & PCM_MONOTONIC)) {
+    // The PCM reports CLOCK_REALTIME, close enough to sample the clock now
+    clock_gettime(CLOCK_MONOTONIC, &tstamp);
+  }
+  engine_publish_position(ext_pcm, buffer_size > avail ? buffer_size - avail : 0, &tstamp);
+  return 0;
+}
 
-  return shared_ext_pcm;
+// Number of silent periods an idle PCM is kept running for
+static unsigned int engine_warm_periods(const struct ext_pcm *ext_pcm) {
+  return ((uint64_t)ext_pcm->warm_standby_ms * ext_pcm->config.rate) /
+         (1000 * ext_pcm->config.period_size);
 }
 
-struct ext_pcm *ext_pcm_open_hfp(unsigned int card, unsigned int device,
-                             unsigned int flags, struct pcm_config *config) {
+static void *engine_thread_loop(void *context) {
+  struct ext_pcm *ext_pcm = (struct ext_pcm *)context;
+  unsigned int silence_periods = 0;
+  unsigned int retry_ms = 0;
+  bool wait_for_data = true;
 
-  struct ext_pcm *ext_pcm = NULL;
-  pthread_mutex_lock(&ext_pcm_init_lock);
+  ALOGD("%s: card %u device %u", __func__, ext_pcm->card, ext_pcm->device);
 
-  ext_pcm = calloc(1, sizeof(struct ext_pcm));
-  pthread_mutex_init(&ext_pcm->lock, (const pthread_mutexattr_t *) NULL);
-  ext_pcm->pcm = pcm_open(card, device, flags, config);
-  pthread_mutex_init(&ext_pcm->mixer_lock, (const pthread_mutexattr_t *)NULL);
-  pthread_cond_init(&ext_pcm->mixer_wake, NULL);
-  pthread_create(&ext_pcm->mixer_thread, (const pthread_attr_t *)NULL,
-          mixer_thread_loop, ext_pcm);
-  ext_pcm->mixer_pipeline_map = hashmapCreate(1, str_hash_fn, str_eq);
-  ext_pcm->ref_count = 1;
-  pthread_mutex_unlock(&ext_pcm_init_lock);
+  while (true) {
+    pthread_mutex_lock(&ext_pcm->lock);
+    while (wait_for_data && !ext_pcm->engine_kicked && !ext_pcm->engine_exit) {
+      pthread_cond_wait(&ext_pcm->engine_wake, &ext_pcm->lock);
+    }
+    if (ext_pcm->engine_exit) {
+      pthread_mutex_unlock(&ext_pcm->lock);
+      break;
+    }
+    ext_pcm->engine_kicked = false;
+    if (ext_pcm->reconfigure) {
+      ext_pcm->reconfigure = false;
+      ext_pcm->config = ext_pcm->pending_config;
+      engine_close_pcm(ext_pcm);
+    }
+    pthread_mutex_unlock(&ext_pcm->lock);
 
-  pthread_mutex_lock(&ext_pcm->lock);
-  ext_pcm->mixer_exit_flag = false;
-  pthread_mutex_unlock(&ext_pcm->lock);
+    // Nothing is pulled without a PCM, so the sources keep their audio, and
+    // the back-off paces the retries
+    if (!ext_pcm->pcm && engine_open_pcm(ext_pcm) != 0) {
+      engine_back_off(ext_pcm, &retry_ms);
+      wait_for_data = false;
+      continue;
+    }
+
+    const unsigned int frame_count =
+        ext_pcm->quantum ? ext_pcm->quantum : ext_pcm->config.period_size;
+    bool active;
+    int frames = engine_mix(ext_pcm, frame_count, &active);
+    if (frames > 0) {
+      // pcm_write() paces the loop while sources keep up
+      if (engine_write(ext_pcm, frames) != 0) {
+        engine_back_off(ext_pcm, &retry_ms);
+      } else {
+        retry_ms = 0;
+        if (ext_pcm->quantum) {
+          engine_throttle(ext_pcm);
+        }
+      }
+      silence_periods = engine_warm_periods(ext_pcm);
+      wait_for_data = false;
+    } else if (!active && silence_periods > 0) {
+      // Warm standby, a source resuming soon finds the PCM still running
+      if (engine_write(ext_pcm, frame_count) != 0) {  // mix_buffer is all zeroes
+        engine_back_off(ext_pcm, &retry_ms);
+      }
+      silence_periods -= 1;
+      wait_for_data = false;
+    } else {
+      if (!active) {
+        engine_close_pcm(ext_pcm);
+      }
+      wait_for_data = true;
+    }
+  }
+
+  engine_close_pcm(ext_pcm);
+  return NULL;
+}
+
+static struct ext_pcm *ext_pcm_create(unsigned int card, unsigned int device,
+                                      unsigned int flags, const struct pcm_config *config,
+                                      unsigned int warm_standby_ms,
+                                      const struct audio_thread_config *engine_thread_config) {
+  struct ext_pcm *ext_pcm = calloc(1, sizeof(struct ext_pcm));
+  if (!ext_pcm) {
+    return NULL;
+  }
+
+  const size_t samples = config->period_size * config->channels;
+  ext_pcm->mix_buffer = calloc(samples, sizeof(ext_pcm->mix_buffer[0]));
+  ext_pcm->write_buffer = calloc(samples, sizeof(ext_pcm->write_buffer[0]));
+  if (!ext_pcm->mix_buffer || !ext_pcm->write_buffer) {
+    free(ext_pcm->mix_buffer);
+    free(ext_pcm->write_buffer);
+    free(ext_pcm);
+    return NULL;
+  }
+
+  ext_pcm->card = card;
+  ext_pcm->device = device;
+  ext_pcm->flags = flags;
+  ext_pcm->warm_standby_ms = warm_standby_ms;
+  ext_pcm->config = *config;
+  atomic_init(&ext_pcm->gain_q15, EXT_PCM_GAIN_UNITY);
+  ext_pcm->applied_gain_q15 = EXT_PCM_GAIN_UNITY;
+  pthread_mutex_init(&ext_pcm->lock, (const pthread_mutexattr_t *)NULL);
+  pthread_mutex_init(&ext_pcm->sources_lock, (const pthread_mutexattr_t *)NULL);
+  // Monotonic for the retry back-off
+  pthread_condattr_t wake_attr;
+  pthread_condattr_init(&wake_attr);
+  pthread_condattr_setclock(&wake_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&ext_pcm->engine_wake, &wake_attr);
+  pthread_condattr_destroy(&wake_attr);
+
+  char name[16];
+  snprintf(name, sizeof(name), "c%ud%u", card, device);
+  if (audio_thread_create(&ext_pcm->engine_thread, engine_thread_config, name,
+                          engine_thread_loop, ext_pcm) != 0) {
+    ALOGE("%s: failed to start engine for card %u device %u", __func__, card, device);
+    pthread_cond_destroy(&ext_pcm->engine_wake);
+    pthread_mutex_destroy(&ext_pcm->sources_lock);
+    pthread_mutex_destroy(&ext_pcm->lock);
+    free(ext_pcm->mix_buffer);
+    free(ext_pcm->write_buffer);
+    free(ext_pcm);
+    return NULL;
+  }
 
   return ext_pcm;
 }
 
-static bool mixer_free_pipeline(__unused void *key, void *value, void *context) {
-  struct ext_mixer_pipeline *pipeline = (struct ext_mixer_pipeline *)value;
-  free(pipeline);
-  return true;
+struct ext_pcm *ext_pcm_open(unsigned int card, unsigned int device,
+                             unsigned int flags, const struct pcm_config *config,
+                             unsigned int warm_standby_ms,
+                             const struct audio_thread_config *engine_thread_config) {
+  struct ext_pcm *ext_pcm;
+
+  pthread_mutex_lock(&ext_pcm_init_lock);
+  for (ext_pcm = ext_pcm_list; ext_pcm; ext_pcm = ext_pcm->next) {
+    if (ext_pcm->card == card && ext_pcm->device == device) {
+      break;
+    }
+  }
+  if (!ext_pcm) {
+    ext_pcm = ext_pcm_create(card, device, flags, config, warm_standby_ms,
+                             engine_thread_config);
+    if (ext_pcm) {
+      ext_pcm->next = ext_pcm_list;
+      ext_pcm_list = ext_pcm;
+    }
+  }
+  if (ext_pcm) {
+    ext_pcm->ref_count += 1;
+  }
+  pthread_mutex_unlock(&ext_pcm_init_lock);
+
+  return ext_pcm;
 }
 
-int ext_pcm_close(struct ext_pcm *ext_pcm, const char *bus_address) {
-  if (ext_pcm == NULL || ext_pcm->pcm == NULL) {
+int ext_pcm_close(struct ext_pcm *ext_pcm) {
+  if (ext_pcm == NULL) {
     return -EINVAL;
   }
 
-  pthread_mutex_lock(&ext_pcm->lock);
+  pthread_mutex_lock(&ext_pcm_init_lock);
   ext_pcm->ref_count -= 1;
-  hashmapRemove(ext_pcm->mixer_pipeline_map, bus_address);
-  pthread_mutex_unlock(&ext_pcm->lock);
+  if (ext_pcm->ref_count == 0) {
+    for (struct ext_pcm **it = &ext_pcm_list; *it; it = &(*it)->next) {
+      if (*it == ext_pcm) {
+        *it = ext_pcm->next;
+        break;
+      }
+    }
 
-  pthread_mutex_lock(&ext_pcm_init_lock);
-  if (ext_pcm->ref_count <= 0) {
     pthread_mutex_lock(&ext_pcm->lock);
-    ext_pcm->mixer_exit_flag = true;
-    pthread_cond_signal(&ext_pcm->mixer_wake);
+    ext_pcm->engine_exit = true;
+    pthread_cond_signal(&ext_pcm->engine_wake);
     pthread_mutex_unlock(&ext_pcm->lock);
-    pcm_close(ext_pcm->pcm);
-    hashmapForEach(ext_pcm->mixer_pipeline_map, mixer_free_pipeline,
-        (void *)NULL);
-    hashmapFree(ext_pcm->mixer_pipeline_map);
-    pthread_join(ext_pcm->mixer_thread, NULL);
-    pthread_cond_destroy(&ext_pcm->mixer_wake);
-    pthread_mutex_destroy(&ext_pcm->mixer_lock);
+    pthread_join(ext_pcm->engine_thread, NULL);
+
+    pthread_cond_destroy(&ext_pcm->engine_wake);
+    pthread_mutex_destroy(&ext_pcm->sources_lock);
     pthread_mutex_destroy(&ext_pcm->lock);
-    if (ext_pcm == shared_ext_pcm)
-      shared_ext_pcm = NULL;
+    free(ext_pcm->mix_buffer);
+    free(ext_pcm->write_buffer);
     free(ext_pcm);
   }
   pthread_mutex_unlock(&ext_pcm_init_lock);
   return 0;
 }
 
-int ext_pcm_is_ready(struct ext_pcm *ext_pcm) {
-  if (ext_pcm == NULL || ext_pcm->pcm == NULL) {
-    return 0;
+int ext_pcm_add_source(struct ext_pcm *ext_pcm, ext_pcm_pull_t pull, void *cookie,
+                       unsigned int quantum) {
+  int ret = 0;
+
+  if (ext_pcm == NULL || pull == NULL) {
+    return -EINVAL;
   }
 
-  return pcm_is_ready(ext_pcm->pcm);
+  pthread_mutex_lock(&ext_pcm->sources_lock);
+  if (ext_pcm->source_count < EXT_PCM_MAX_SOURCES) {
+    ext_pcm->sources[ext_pcm->source_count].pull = pull;
+    ext_pcm->sources[ext_pcm->source_count].cookie = cookie;
+    ext_pcm->sources[ext_pcm->source_count].quantum = quantum;
+    ext_pcm->source_count += 1;
+  } else {
+    ALOGE("%s: card %u device %u has too many sources", __func__,
+          ext_pcm->card, ext_pcm->device);
+    ret = -ENOSPC;
+  }
+  pthread_mutex_unlock(&ext_pcm->sources_lock);
+  return ret;
 }
 
-int ext_pcm_write(struct ext_pcm *ext_pcm, const char *address,
-                  const void *data, unsigned int count) {
-  if (ext_pcm == NULL || ext_pcm->pcm == NULL) {
-    return -EINVAL;
+void ext_pcm_remove_source(struct ext_pcm *ext_pcm, void *cookie) {
+  if (ext_pcm == NULL) {
+    return;
   }
 
-  return mixer_pipeline_write(ext_pcm, address, data, count);
+  // The engine holds sources_lock for the whole mix cycle, so once this
+  // returns the source is never called again
+  pthread_mutex_lock(&ext_pcm->sources_lock);
+  for (unsigned int i = 0; i < ext_pcm->source_count; i++) {
+    if (ext_pcm->sources[i].cookie == cookie) {
+      ext_pcm->source_count -= 1;
+      ext_pcm->sources[i] = ext_pcm->sources[ext_pcm->source_count];
+      break;
+    }
+  }
+  pthread_mutex_unlock(&ext_pcm->sources_lock);
 }
 
-const char *ext_pcm_get_error(struct ext_pcm *ext_pcm) {
-  if (ext_pcm == NULL || ext_pcm->pcm == NULL) {
-    return NULL;
+void ext_pcm_kick(struct ext_pcm *ext_pcm) {
+  if (ext_pcm == NULL) {
+    return;
   }
 
-  return pcm_get_error(ext_pcm->pcm);
+  pthread_mutex_lock(&ext_pcm->lock);
+  ext_pcm->engine_kicked = true;
+  pthread_cond_signal(&ext_pcm->engine_wake);
+  pthread_mutex_unlock(&ext_pcm->lock);
 }
 
-unsigned int ext_pcm_frames_to_bytes(struct ext_pcm *ext_pcm,
-                                     unsigned int frames) {
-  if (ext_pcm == NULL || ext_pcm->pcm == NULL) {
-    return -EINVAL;
+int ext_pcm_get_position(struct ext_pcm *ext_pcm, uint64_t *written, unsigned int *queued,
+                         struct timespec *timestamp) {
+  int64_t time_ns;
+  unsigned int seq;
+  do {
+    seq = audio_seqlock_read_begin(&ext_pcm->position_lock);
+    *written = atomic_load_explicit(&ext_pcm->position_written, memory_order_relaxed);
+    *queued = atomic_load_explicit(&ext_pcm->position_queued, memory_order_relaxed);
+    time_ns = atomic_load_explicit(&ext_pcm->position_time_ns, memory_order_relaxed);
+  } while (audio_seqlock_read_retry(&ext_pcm->position_lock, seq));
+
+  if (time_ns == 0) {
+    return -ENODATA;
   }
+  timestamp->tv_sec = time_ns / 1000000000LL;
+  timestamp->tv_nsec = time_ns % 1000000000LL;
+  return 0;
+}
 
-  return pcm_frames_to_bytes(ext_pcm->pcm, frames);
+void ext_pcm_set_gain(struct ext_pcm *ext_pcm, int32_t gain_q15) {
+  atomic_store_explicit(&ext_pcm->gain_q15, gain_q15, memory_order_relaxed);
 }
 
-unsigned int ext_pcm_bytes_to_frames(struct ext_pcm *ext_pcm,
-                                     unsigned int bytes) {
-  if (ext_pcm == NULL || ext_pcm->pcm == NULL) {
-    return -EINVAL;
+void ext_pcm_set_device_gain(unsigned int card, unsigned int device, int32_t gain_q15) {
+  pthread_mutex_lock(&ext_pcm_init_lock);
+  for (struct ext_pcm *ext_pcm = ext_pcm_list; ext_pcm; ext_pcm = ext_pcm->next) {
+    if (ext_pcm->card == card && ext_pcm->device == device) {
+      ext_pcm_set_gain(ext_pcm, gain_q15);
+    }
+  }
+  pthread_mutex_unlock(&ext_pcm_init_lock);
+}
+
+void ext_pcm_reconfigure(struct ext_pcm *ext_pcm, const struct pcm_config *config) {
+  if (ext_pcm == NULL) {
+    return;
   }
 
-  return pcm_bytes_to_frames(ext_pcm->pcm, bytes);
+  pthread_mutex_lock(&ext_pcm->lock);
+  ext_pcm->pending_config = *config;
+  ext_pcm->reconfigure = true;
+  ext_pcm->engine_kicked = true;
+  pthread_cond_signal(&ext_pcm->engine_wake);
+  pthread_mutex_unlock(&ext_pcm->lock);
 }
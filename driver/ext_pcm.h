@@ -18,42 +18,106 @@
 #define EXT_PCM_H
 
 #include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <time.h>
 
-#include <cutils/hashmap.h>
 #include <tinyalsa/asoundlib.h>
 
-// Holds up to 4KB buffer for each mixer pipeline, this value is arbitrary chosen
-#define MIXER_BUFFER_SIZE (1024 * 4)
+#include "audio_seqlock.h"
+#include "audio_thread.h"
+
+// Maximum number of streams mixed into one PCM
+#define EXT_PCM_MAX_SOURCES 16
+
+// Q15 gain of the final mix, see ext_pcm_set_gain()
+#define EXT_PCM_GAIN_UNITY (1 << 15)
 
-struct ext_mixer_pipeline {
-  int16_t buffer[MIXER_BUFFER_SIZE];
-  unsigned int position;
+// Called by the engine thread once per period. Adds up to frame_count frames
+// (PCM channel count, 16 bit samples) of the source to the int32 accumulator
+// mix and returns the number of frames added. Returns 0 when the source is
+// running but has no data yet and -ENODATA when it is in standby. position is
+// the engine frame the mix starts at, see ext_pcm_get_position().
+typedef int (*ext_pcm_pull_t)(void *cookie, int32_t *mix, unsigned int frame_count,
+                              uint64_t position);
+
+struct ext_pcm_source {
+  ext_pcm_pull_t pull;
+  void *cookie;
+  unsigned int quantum;  // Frames per cycle the source needs, 0 for the PCM period
 };
 
+// One output engine per ALSA PCM. A single thread pulls every registered
+// source, mixes them in one pass and writes the result to the PCM. The PCM is
+// opened when data arrives. Once every source is in standby it keeps running
+// on silence for warm_standby_ms and is closed afterwards.
 struct ext_pcm {
-  struct pcm *pcm;
+  struct ext_pcm *next;              // Protected by ext_pcm_init_lock
+  unsigned int ref_count;            // Protected by ext_pcm_init_lock
+  unsigned int card;                 // Constant after init
+  unsigned int device;               // Constant after init
+  unsigned int flags;                // Constant after init
+  unsigned int warm_standby_ms;      // Constant after init
+
   pthread_mutex_t lock;
-  unsigned int ref_count;
-  pthread_mutex_t mixer_lock;
-  struct ext_mixer_pipeline mixer_pipeline;
-  pthread_t mixer_thread;
-  Hashmap *mixer_pipeline_map;
-  bool mixer_exit_flag;
-  pthread_cond_t mixer_wake;
+  pthread_cond_t engine_wake;        // Protected by this->lock
+  bool engine_kicked;                // Protected by this->lock
+  bool engine_exit;                  // Protected by this->lock
+  bool reconfigure;                  // Protected by this->lock
+  struct pcm_config pending_config;  // Protected by this->lock
+
+  atomic_int gain_q15;               // Final mix gain the engine ramps to
+
+  pthread_mutex_t sources_lock;      // Held by the engine while mixing
+  struct ext_pcm_source sources[EXT_PCM_MAX_SOURCES];  // Protected by sources_lock
+  unsigned int source_count;                           // Protected by sources_lock
+
+  // Owned by the engine thread
+  pthread_t engine_thread;
+  struct pcm *pcm;
+  struct pcm_config config;
+  unsigned int quantum;              // Smallest quantum of the sources active last cycle
+  int32_t *mix_buffer;
+  int16_t *write_buffer;
+  uint64_t written;                  // Frames written since the engine was created
+  int32_t applied_gain_q15;          // Final mix gain of the last write
+
+  // Hardware position after the last write, read lock-free by the streams
+  audio_seqlock_t position_lock;
+  atomic_uint_least64_t position_written;
+  atomic_uint position_queued;
+  atomic_int_least64_t position_time_ns;
 };
 
-struct ext_pcm *ext_pcm_open_default(unsigned int card, unsigned int device,
-                             unsigned int flags, struct pcm_config *config);
-struct ext_pcm *ext_pcm_open_hfp(unsigned int card, unsigned int device,
-                             unsigned int flags, struct pcm_config *config);
-int ext_pcm_close(struct ext_pcm *ext_pcm, const char *bus_address);
-int ext_pcm_is_ready(struct ext_pcm *ext_pcm);
-int ext_pcm_write(struct ext_pcm *ext_pcm, const char *bus_address,
-                  const void *data, unsigned int count);
-const char *ext_pcm_get_error(struct ext_pcm *ext_pcm);
-unsigned int ext_pcm_frames_to_bytes(struct ext_pcm *ext_pcm,
-                                     unsigned int frames);
-unsigned int ext_pcm_bytes_to_frames(struct ext_pcm *ext_pcm,
-                                     unsigned int bytes);
+// Returns the engine of card/device, creating it on first use
+struct ext_pcm *ext_pcm_open(unsigned int card, unsigned int device,
+                             unsigned int flags, const struct pcm_config *config,
+                             unsigned int warm_standby_ms,
+                             const struct audio_thread_config *engine_thread_config);
+int ext_pcm_close(struct ext_pcm *ext_pcm);
+// A non-zero quantum marks a low-latency source. While one is active the
+// engine mixes in quanta of that size and keeps only a few of them queued
+// in the PCM instead of filling its whole buffer.
+int ext_pcm_add_source(struct ext_pcm *ext_pcm, ext_pcm_pull_t pull, void *cookie,
+                       unsigned int quantum);
+void ext_pcm_remove_source(struct ext_pcm *ext_pcm, void *cookie);
+// Wakes the engine after a source received new data
+void ext_pcm_kick(struct ext_pcm *ext_pcm);
+// Returns the engine position as of the last write: frames written since
+// the engine was created, how many of those were still queued in the PCM and
+// when that was sampled (CLOCK_MONOTONIC). Does not block the engine.
+// Returns -ENODATA before the first write.
+int ext_pcm_get_position(struct ext_pcm *ext_pcm, uint64_t *written, unsigned int *queued,
+                         struct timespec *timestamp);
+// Sets the gain applied to the final mix of the engine, Q15 below
+// 2 * EXT_PCM_GAIN_UNITY. A running engine ramps to it over one write.
+void ext_pcm_set_gain(struct ext_pcm *ext_pcm, int32_t gain_q15);
+// Same for the engine of card and device, if it is open
+void ext_pcm_set_device_gain(unsigned int card, unsigned int device, int32_t gain_q15);
+// Reopens the PCM with a new rate at the next period; channels, format and
+// period size must not change
+void ext_pcm_reconfigure(struct ext_pcm *ext_pcm, const struct pcm_config *config);
 
 #endif  // EXT_PCM_H
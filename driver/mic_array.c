@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2019 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_generic"
+
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+
+#include <log/log.h>
+
+#include "bus_gain.h"
+#include "mic_array.h"
+
+static bool position_known(const struct audio_microphone_coordinate *position) {
+    return position->x != AUDIO_MICROPHONE_COORDINATE_UNKNOWN &&
+           position->y != AUDIO_MICROPHONE_COORDINATE_UNKNOWN &&
+           position->z != AUDIO_MICROPHONE_COORDINATE_UNKNOWN;
+}
+
+static float distance(const struct audio_microphone_coordinate *a,
+                      const struct audio_microphone_coordinate *b) {
+    const float dx = a->x - b->x;
+    const float dy = a->y - b->y;
+    const float dz = a->z - b->z;
+    return sqrtf(dx * dx + dy * dy + dz * dz);
+}
+
+size_t beamformer_history_bytes(const struct mic_array *array) {
+    // Two copies, see beamformer_process()
+    return 2 * BEAMFORMER_MAX_DELAY * array->num_mics * sizeof(int16_t);
+}
+
+int beamformer_init(struct beamformer *beamformer, const struct mic_array *array,
+                    unsigned int pcm_channels, unsigned int rate, void *history) {
+    memset(beamformer, 0, sizeof(*beamformer));
+    if (!array->has_beam || array->num_mics < 2) {
+        return -EINVAL;
+    }
+
+    float paths[MIC_ARRAY_MAX_MICS];
+    float longest = 0;
+    for (unsigned int i = 0; i < array->num_mics; i++) {
+        const struct mic_array_mic *mic = &array->mics[i];
+        if (!position_known(&mic->position) || mic->channel >= pcm_channels) {
+            ALOGW("%s: %s cannot be steered", __func__, mic->id);
+            return -EINVAL;
+        }
+        paths[i] = distance(&mic->position, &array->beam_target);
+        longest = paths[i] > longest ? paths[i] : longest;
+    }
+
+    // The microphone closest to the target hears it first and waits longest
+    for (unsigned int i = 0; i < array->num_mics; i++) {
+        const long delay = lrintf((longest - paths[i]) * rate / SPEED_OF_SOUND_M_S);
+        if (delay > BEAMFORMER_MAX_DELAY) {
+            ALOGW("%s: the array is too wide to steer at %u Hz", __func__, rate);
+            return -EINVAL;
+        }
+        beamformer->channel[i] = array->mics[i].channel;
+        beamformer->delay[i] = delay;
+        if (beamformer->delay[i] > beamformer->max_delay) {
+            beamformer->max_delay = beamformer->delay[i];
+        }
+    }
+    beamformer->num_mics = array->num_mics;
+    beamformer->pcm_channels = pcm_channels;
+    beamformer->scale_q15 = GAIN_Q15_UNITY / array->num_mics;
+    beamformer->history = history;
+    beamformer->next_history = beamformer->history + beamformer->max_delay * array->num_mics;
+    beamformer_reset(beamformer);
+    ALOGI("%s: %u microphones, %u frames across", __func__, array->num_mics,
+          beamformer->max_delay);
+    return 0;
+}
+
+void beamformer_reset(struct beamformer *beamformer) {
+    if (beamformer->history) {
+        memset(beamformer->history, 0,
+               2 * beamformer->max_delay * beamformer->num_mics * sizeof(int16_t));
+    }
+}
+
+// Sample of microphone m at frame, which is in the history when negative
+static inline int16_t mic_sample(const struct beamformer *beamformer, const int16_t *buffer,
+                                 long frame, unsigned int m) {
+    if (frame >= 0) {
+        return buffer[frame * beamformer->pcm_channels + beamformer->channel[m]];
+    }
+    return beamformer->history[((long)beamformer->max_delay + frame) * beamformer->num_mics + m];
+}
+
+void beamformer_process(struct beamformer *beamformer, int16_t *buffer, size_t frame_count,
+                        unsigned int out_channels) {
+    const unsigned int num_mics = beamformer->num_mics;
+    const unsigned int max_delay = beamformer->max_delay;
+
+    // The raw tail is kept for the next buffer before the beam overwrites it
+    for (unsigned int i = 0; i < max_delay; i++) {
+        const long frame = (long)frame_count - (long)max_delay + (long)i;
+        for (unsigned int m = 0; m < num_mics; m++) {
+            beamformer->next_history[i * num_mics + m] =
+                    mic_sample(beamformer, buffer, frame, m);
+        }
+    }
+
+    // A frame only reads itself and earlier frames, going backwards each one
+    // is overwritten after every frame that reads it
+    for (long frame = (long)frame_count - 1; frame >= 0; frame--) {
+        int32_t sum = 0;
+        for (unsigned int m = 0; m < num_mics; m++) {
+            sum += mic_sample(beamformer, buffer, frame - (long)beamformer->delay[m], m);
+        }
+        // scale_q15 is unity over num_mics, the product fits in 32 bit
+        const int32_t beam = (sum * beamformer->scale_q15) >> 15;
+        const int16_t sample = beam > INT16_MAX ? INT16_MAX :
+                               beam < INT16_MIN ? INT16_MIN : (int16_t)beam;
+        int16_t *out = buffer + frame * beamformer->pcm_channels;
+        for (unsigned int ch = 0; ch < out_channels; ch++) {
+            out[ch] = sample;
+        }
+    }
+
+    int16_t *history = beamformer->history;
+    beamformer->history = beamformer->next_history;
+    beamformer->next_history = history;
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2019 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MIC_ARRAY_H
+#define MIC_ARRAY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <system/audio.h>
+
+// Microphones of the capture PCM that can be described, one per channel
+#define MIC_ARRAY_MAX_MICS 8
+
+// Longest delay of the beamformer, 128 frames at 48 kHz is 0.9 m of
+// difference between the paths from the target to two microphones
+#define BEAMFORMER_MAX_DELAY 128
+
+#define SPEED_OF_SOUND_M_S 343.0f
+
+struct mic_array_mic {
+    char id[AUDIO_MICROPHONE_ID_MAX_LEN];
+    unsigned int channel;                               // Channel of the capture PCM
+    audio_microphone_location_t location;
+    audio_microphone_directionality_t directionality;
+    struct audio_microphone_coordinate position;        // Meters, Android device frame
+    struct audio_microphone_coordinate orientation;
+};
+
+// Microphones wired to the capture PCM and, optionally, the point a
+// beamformer is steered at, e.g. the head of the driver
+struct mic_array {
+    unsigned int num_mics;              // 0 if the board does not describe them
+    struct mic_array_mic mics[MIC_ARRAY_MAX_MICS];
+    bool has_beam;
+    struct audio_microphone_coordinate beam_target;
+};
+
+// Delay-and-sum beamformer. Every microphone is delayed so that sound from
+// the target lines up across them, then they are averaged. Delays are
+// rounded to whole frames, which at 48 kHz is within 7 mm of path.
+struct beamformer {
+    unsigned int num_mics;
+    unsigned int pcm_channels;
+    unsigned int channel[MIC_ARRAY_MAX_MICS];   // PCM channel of each microphone
+    unsigned int delay[MIC_ARRAY_MAX_MICS];     // In frames
+    unsigned int max_delay;
+    int32_t scale_q15;                          // Averages the microphones
+    int16_t *history;       // Last max_delay frames of each microphone
+    int16_t *next_history;  // Swapped with history after each buffer
+};
+
+// Bytes of history the beamformer of array needs, see beamformer_init()
+size_t beamformer_history_bytes(const struct mic_array *array);
+// Works out the delays of array for a PCM of pcm_channels at rate. history
+// holds beamformer_history_bytes(). Returns -EINVAL if the array has no beam
+// target, a microphone of unknown position or one outside the PCM, or spans
+// more than BEAMFORMER_MAX_DELAY.
+int beamformer_init(struct beamformer *beamformer, const struct mic_array *array,
+                    unsigned int pcm_channels, unsigned int rate, void *history);
+// Forgets the audio before a capture restarts
+void beamformer_reset(struct beamformer *beamformer);
+// Writes the beam over the first out_channels of every frame of buffer, in
+// place, so that dropping the other channels leaves the steered signal
+void beamformer_process(struct beamformer *beamformer, int16_t *buffer, size_t frame_count,
+                        unsigned int out_channels);
+
+#endif  // MIC_ARRAY_H
@@ -1,17 +1,52 @@
 #ifndef AUDIO_HAL_TYPES_H
 #define AUDIO_HAL_TYPES_H
 
+#include <system/audio.h>
+
 struct route_setting
 {
-    const char *    ctl_name;
-    int             intval;
-    const char *    strval;
+    const char *        ctl_name;
+    int                 intval;
+    const char *        strval;
+    struct mixer_ctl *  ctl;        /* Resolved when the mixer is opened */
+};
+
+/* Device to device path the codec can carry without the CPU */
+struct hw_route
+{
+    audio_devices_t         source;         /* AUDIO_DEVICE_NONE ends the table */
+    audio_devices_t         sink;
+    const char *            sink_address;   /* NULL matches any address */
+    struct route_setting *  route;          /* Set while a patch uses the path */
+};
+
+/* Codec volume of a bus that has outputs of its own, e.g. a DAC pair */
+struct bus_volume
+{
+    const char *        bus_address;    /* NULL ends the table */
+    const char *        ctl_name;
+    int                 db_min;         /* Millibels of the lowest control value */
+    int                 db_step;        /* Millibels per control value */
+    struct mixer_ctl *  ctl;            /* Resolved when the mixer is opened */
+};
+
+/* Codec capture volume whose value scales with amplitude, e.g. a DVC */
+struct capture_volume
+{
+    const char *        ctl_name;       /* NULL ends the table */
+    int                 unity;          /* Control value of 0 dB */
+    struct mixer_ctl *  ctl;            /* Resolved when the mixer is opened */
+    unsigned int        users;          /* Inputs capturing from the card */
+    float               gain;           /* Amplitude ratio set, 0 before the first */
 };
 
 struct device_card
 {
     unsigned int card;
     struct route_setting* defaults;
+    struct hw_route* routes;        /* NULL if the card has no hardware routes */
+    struct bus_volume* volumes;     /* NULL if all buses share the outputs */
+    struct capture_volume* capture_volumes; /* NULL if input gain is applied in software */
     struct mixer* mixer;
 };
 
@@ -43,19 +43,27 @@
 #define PCM_CARD_HFP              PCM_CARD_GEN3_HFP
 #define PCM_DEVICE_HFP            PCM_DEVICE_GEN3_HFP
 
+/* AK4613 of the ULCB base board, left to MMAP streams by the TDM codec */
+#define PCM_CARD_GEN3_AK4613      1
+#define PCM_DEVICE_GEN3_AK4613    0
+#define PCM_CARD_MMAP             PCM_CARD_GEN3_AK4613
+#define PCM_DEVICE_MMAP           PCM_DEVICE_GEN3_AK4613
+#define PCM_CARD_MMAP_IN          PCM_CARD_GEN3_AK4613
+#define PCM_DEVICE_MMAP_IN        PCM_DEVICE_GEN3_AK4613
+
 #define IN_CHANNELS_DEFAULT 6
 #define OUT_CHANNELS_DEFAULT 8
 #define IN_CHANNELS_FM 2
 #define IN_CHANNELS_HFP 2
 #define OUT_CHANNELS_HFP 2
+#define OUT_CHANNELS_MMAP 2
+#define IN_CHANNELS_MMAP 2
 
 #define DEFAULT_OUT_SAMPLING_RATE   48000
 #define DEFAULT_IN_SAMPLING_RATE    48000
 
 #define DEFAULT_HFP_SAMPLING_RATE   16000
 
-#define HFP_STREAM_BT_OUT_ADDRESS   "bus9_hfp_call_out"
-
 /* These are values that never change */
 struct route_setting defaults[] = {
     /* playback */
@@ -120,6 +128,17 @@ struct route_setting defaultsfm[] = {
     { .ctl_name = NULL, },
 };
 
+/* The ADCs step in dB, only the FM DVC takes the input gain in hardware */
+struct capture_volume capture_volumesfm[] = {
+    {
+        .ctl_name = MIXER_DVC_IN_CAPTURE_VOL,
+        .unity = MIXER_DVC_IN_CAP_VOL_DEF,
+    },
+
+    /* end of list */
+    { .ctl_name = NULL, },
+};
+
 struct device_card cards[] = {
     {
         .card = PCM_CARD_GEN3,
@@ -129,6 +148,7 @@ struct device_card cards[] = {
     {
         .card = PCM_CARD_GEN3_FM,
         .defaults = defaultsfm,
+        .capture_volumes = capture_volumesfm,
         .mixer = 0,
     },
     {
@@ -43,10 +43,22 @@ struct route_setting defaults[] = {
     },
 };
 
+/* Input gain goes to the DVC, which is linear in amplitude */
+struct capture_volume capture_volumes[] = {
+    {
+        .ctl_name = MIXER_CAPTURE_VOL,
+        .unity = MIXER_CAPTURE_V_DEFAULT,
+    },
+    {
+        .ctl_name = NULL,
+    },
+};
+
 struct device_card cards[] = {
     {
         .card = PCM_CARD_GEN3,
         .defaults = defaults,
+        .capture_volumes = capture_volumes,
         .mixer = 0,
     },
     {